@@ -0,0 +1,336 @@
+/*
+ * Insert and replay throughput benchmark for sqlite:// and jsqlite:// channels
+ *
+ * Usage: sqlite-bench [-n count] [-d module-dir] [-o db-dir] [-f filter]
+ */
+
+#include <tll/channel.h>
+#include <tll/config.h>
+#include <tll/logger.h>
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace std::chrono;
+
+namespace {
+
+/// Layout of default tll offset pointer
+struct offset_ptr_t
+{
+	uint32_t offset;
+	uint32_t size : 24;
+	uint32_t entity : 8;
+};
+
+struct Scheme
+{
+	std::string name;
+	std::string yaml;
+	/// Fill message body for row i, return body size
+	size_t (*fill)(std::vector<char> &buf, long long i);
+};
+
+constexpr size_t string_size = 48;
+constexpr unsigned wide_fields = 16;
+
+size_t fill_narrow(std::vector<char> &buf, long long i)
+{
+	buf.resize(20);
+	int64_t f0 = i;
+	int32_t f1 = i & 0xffff;
+	double f2 = i * 0.5;
+	memcpy(buf.data(), &f0, 8);
+	memcpy(buf.data() + 8, &f1, 4);
+	memcpy(buf.data() + 12, &f2, 8);
+	return buf.size();
+}
+
+size_t fill_wide(std::vector<char> &buf, long long i)
+{
+	buf.resize(wide_fields * 16);
+	for (unsigned j = 0; j < wide_fields; j++) {
+		int64_t iv = i + j;
+		double dv = i * 0.1 + j;
+		memcpy(buf.data() + j * 8, &iv, 8);
+		memcpy(buf.data() + (wide_fields + j) * 8, &dv, 8);
+	}
+	return buf.size();
+}
+
+void fill_string(char * ptr, long long i)
+{
+	snprintf(ptr, string_size, "string-value-%020lld-padding", i);
+}
+
+size_t fill_fixed(std::vector<char> &buf, long long i)
+{
+	buf.resize(8 + 64);
+	memset(buf.data(), 0, buf.size());
+	int64_t id = i;
+	memcpy(buf.data(), &id, 8);
+	fill_string(buf.data() + 8, i);
+	return buf.size();
+}
+
+size_t fill_pointer(std::vector<char> &buf, long long i)
+{
+	buf.resize(8 + sizeof(offset_ptr_t) + string_size);
+	memset(buf.data(), 0, buf.size());
+	int64_t id = i;
+	memcpy(buf.data(), &id, 8);
+	auto str = buf.data() + 8 + sizeof(offset_ptr_t);
+	fill_string(str, i);
+	offset_ptr_t ptr = {};
+	ptr.offset = sizeof(offset_ptr_t);
+	ptr.size = strlen(str) + 1;
+	ptr.entity = 1;
+	memcpy(buf.data() + 8, &ptr, sizeof(ptr));
+	buf.resize(8 + sizeof(offset_ptr_t) + ptr.size);
+	return buf.size();
+}
+
+std::vector<Scheme> schemes()
+{
+	std::string wide;
+	for (unsigned j = 0; j < wide_fields; j++)
+		wide += fmt::format("    - {{name: i{}, type: int64}}\n", j);
+	for (unsigned j = 0; j < wide_fields; j++)
+		wide += fmt::format("    - {{name: d{}, type: double}}\n", j);
+
+	return {
+		{ "narrow", R"(yamls://
+- name: bench
+  id: 10
+  fields:
+    - {name: f0, type: int64}
+    - {name: f1, type: int32}
+    - {name: f2, type: double}
+)", fill_narrow },
+		{ "wide", "yamls://\n- name: bench\n  id: 10\n  fields:\n" + wide, fill_wide },
+		{ "fixed-string", R"(yamls://
+- name: bench
+  id: 10
+  fields:
+    - {name: id, type: int64}
+    - {name: s, type: byte64, options.type: string}
+)", fill_fixed },
+		{ "pointer-string", R"(yamls://
+- name: bench
+  id: 10
+  fields:
+    - {name: id, type: int64}
+    - {name: s, type: string}
+)", fill_pointer },
+	};
+}
+
+struct Stats
+{
+	std::vector<long long> latency; ///< Per operation latency in ns
+	size_t bytes = 0;
+	nanoseconds elapsed = {};
+
+	void report(std::string_view name) const
+	{
+		auto sorted = latency;
+		std::sort(sorted.begin(), sorted.end());
+		auto pct = [&sorted](double p) -> long long {
+			if (sorted.empty())
+				return 0;
+			return sorted[std::min(sorted.size() - 1, (size_t) (sorted.size() * p))];
+		};
+		auto sec = duration<double>(elapsed).count();
+		auto count = latency.size();
+		fmt::print("{:<48} {:>9} msg {:>12.0f} msg/s {:>9.2f} MB/s  p50 {:>7}ns p99 {:>8}ns p99.9 {:>9}ns max {:>10}ns\n"
+			, name, count, count / sec, bytes / sec / 1024 / 1024
+			, pct(0.5), pct(0.99), pct(0.999), pct(1));
+	}
+};
+
+struct Reader
+{
+	Stats stats;
+	size_t rows = 0;
+	bool eod = false;
+
+	int callback(const tll::Channel *, const tll_msg_t *msg)
+	{
+		if (msg->type == TLL_MESSAGE_CONTROL) {
+			eod = true;
+			return 0;
+		}
+		if (msg->type != TLL_MESSAGE_DATA)
+			return 0;
+		rows++;
+		stats.bytes += msg->size;
+		return 0;
+	}
+};
+
+struct Bench
+{
+	tll::channel::Context context { tll::Config() };
+	std::string dir = "/tmp";
+	std::string filter;
+	long long count = 100000;
+
+	std::string db(std::string_view name)
+	{
+		auto path = fmt::format("{}/sqlite-bench-{}.db", dir, name);
+		for (auto suffix : { "", "-wal", "-shm" })
+			unlink((path + suffix).c_str());
+		return path;
+	}
+
+	std::unique_ptr<tll::Channel> channel(std::string_view proto, std::string_view path, const Scheme &scheme, std::string_view dir, const std::vector<std::pair<std::string, std::string>> &params)
+	{
+		tll::Config url;
+		url.set("tll.proto", proto);
+		url.set("tll.host", path);
+		url.set("name", fmt::format("bench-{}", dir));
+		url.set("dir", dir);
+		url.set("scheme", scheme.yaml);
+		url.set("table", "bench");
+		for (auto & [k, v] : params)
+			url.set(k, v);
+		return context.channel(url);
+	}
+
+	int write(std::string_view name, std::string_view proto, std::string_view path, const Scheme &scheme, long long count, const std::vector<std::pair<std::string, std::string>> &params)
+	{
+		auto c = channel(proto, path, scheme, "w", params);
+		if (!c || c->open())
+			return fmt::print(stderr, "Failed to open writer for {}\n", name), EINVAL;
+
+		Stats stats;
+		stats.latency.reserve(count);
+		std::vector<char> buf;
+		tll_msg_t msg = {};
+		msg.msgid = 10;
+
+		auto start = steady_clock::now();
+		for (long long i = 0; i < count; i++) {
+			msg.seq = i;
+			msg.size = scheme.fill(buf, i);
+			msg.data = buf.data();
+			auto t0 = steady_clock::now();
+			if (c->post(&msg))
+				return fmt::print(stderr, "Post failed for {} at {}\n", name, i), EINVAL;
+			stats.latency.push_back(duration_cast<nanoseconds>(steady_clock::now() - t0).count());
+			stats.bytes += msg.size;
+		}
+		c->close();
+		stats.elapsed = steady_clock::now() - start;
+		stats.report(name);
+		return 0;
+	}
+
+	/// Read all rows, open parameters select table for typed reader which is created in rw mode
+	int read(std::string_view name, std::string_view proto, std::string_view path, const Scheme &scheme, long long count, std::string_view dir, std::string_view open, const std::vector<std::pair<std::string, std::string>> &params)
+	{
+		auto c = channel(proto, path, scheme, dir, params);
+		Reader reader;
+		if (!c)
+			return fmt::print(stderr, "Failed to create reader for {}\n", name), EINVAL;
+		c->callback_add(&reader, TLL_MESSAGE_MASK_DATA | TLL_MESSAGE_MASK_CONTROL);
+		reader.stats.latency.reserve(count);
+
+		auto start = steady_clock::now();
+		if (c->open(open))
+			return fmt::print(stderr, "Failed to open reader for {}\n", name), EINVAL;
+		while (!reader.eod && c->state() == TLL_STATE_ACTIVE) {
+			auto rows = reader.rows;
+			auto t0 = steady_clock::now();
+			c->process();
+			if (reader.rows != rows)
+				reader.stats.latency.push_back(duration_cast<nanoseconds>(steady_clock::now() - t0).count());
+		}
+		reader.stats.elapsed = steady_clock::now() - start;
+		c->close();
+		if (reader.rows != (size_t) count)
+			return fmt::print(stderr, "Reader for {} got {} rows, expected {}\n", name, reader.rows, count), EINVAL;
+		reader.stats.report(name);
+		return 0;
+	}
+
+	bool skip(std::string_view name) const { return filter.size() && name.find(filter) == name.npos; }
+
+	int run()
+	{
+		const std::vector<long long> bulk = { 1, 100, 1000, 10000 };
+		for (auto & s : schemes()) {
+			for (auto b : bulk) {
+				// Commit per message is fsync bound, keep it short
+				auto n = b == 1 ? std::max(100ll, count / 100) : count;
+				for (auto replace : { false, true }) {
+					auto name = fmt::format("sqlite/{}/write/bulk-{}{}", s.name, b, replace ? "/replace" : "");
+					if (skip(name))
+						continue;
+					auto path = db(s.name);
+					if (write(name, "sqlite", path, s, n, {{"bulk-size", std::to_string(b)}, {"replace", replace ? "yes" : "no"}}))
+						return EINVAL;
+					if (b != bulk.back() || replace)
+						continue;
+					name = fmt::format("sqlite/{}/read", s.name);
+					if (!skip(name) && read(name, "sqlite", path, s, n, "rw", "table=bench", {}))
+						return EINVAL;
+				}
+
+				auto name = fmt::format("jsqlite/{}/write/bulk-{}", s.name, b);
+				if (skip(name))
+					continue;
+				auto path = db("j" + s.name);
+				if (write(name, "jsqlite", path, s, n, {{"bulk-size", std::to_string(b)}}))
+					return EINVAL;
+				if (b != bulk.back())
+					continue;
+				name = fmt::format("jsqlite/{}/read", s.name);
+				if (!skip(name) && read(name, "jsqlite", path, s, n, "r", "", {{"autoclose", "yes"}}))
+					return EINVAL;
+			}
+		}
+		return 0;
+	}
+};
+
+}
+
+int main(int argc, char *argv[])
+{
+	Bench bench;
+	std::string modules = getenv("BUILD_DIR") ? getenv("BUILD_DIR") : "build";
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:d:o:f:h")) != -1) {
+		switch (opt) {
+		case 'n': bench.count = std::max(1ll, atoll(optarg)); break;
+		case 'd': modules = optarg; break;
+		case 'o': bench.dir = optarg; break;
+		case 'f': bench.filter = optarg; break;
+		default:
+			fmt::print(stderr, "Usage: {} [-n count] [-d module-dir] [-o db-dir] [-f filter]\n", argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	tll_logger_set("tll", TLL_LOGGER_WARNING, 1);
+
+	for (auto m : { "tll-sqlite", "tll-jsqlite" }) {
+		if (bench.context.load(fmt::format("{}/{}", modules, m))) {
+			fmt::print(stderr, "Failed to load module {} from {}\n", m, modules);
+			return 1;
+		}
+	}
+
+	return bench.run() ? 1 : 0;
+}
@@ -0,0 +1,359 @@
+#ifndef _BIND_H
+#define _BIND_H
+
+#include <sqlite3.h>
+
+#include <cstring>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <tll/scheme.h>
+#include <tll/scheme/util.h>
+#include <tll/util/memoryview.h>
+
+#include "compress.h"
+
+namespace sqlite_bind {
+
+/// Single field operation in precompiled bind plan
+struct op_t
+{
+	enum Kind : unsigned char { Int8, Int16, Int32, Int64, UInt8, UInt16, UInt32, UInt64, Double, String, Blob, PtrString };
+
+	Kind kind;
+	unsigned offset; ///< Field offset in message body
+	unsigned size; ///< Field size
+	const tll::scheme::Field * field;
+	std::string name; ///< Column name, nested fields are prefixed with outer ones: outer.inner
+	std::shared_ptr<const sqlite_compress::Compressor> compress; ///< Codec of string or blob column, stored as BLOB
+};
+
+/// Flat list of bind operations in column order, compiled once from message fields
+using plan_t = std::vector<op_t>;
+
+/// Field has no pointers and can be copied as is
+inline bool fixed(const tll::scheme::Field *field)
+{
+	using tll::scheme::Field;
+	switch (field->type) {
+	case Field::Pointer: return false;
+	case Field::Array: return fixed(field->type_array);
+	case Field::Message:
+		for (auto f = field->type_msg->fields; f; f = f->next) {
+			if (!fixed(f))
+				return false;
+		}
+		return true;
+	case Field::Union:
+		for (auto i = 0u; i < field->type_union->fields_size; i++) {
+			if (!fixed(&field->type_union->fields[i]))
+				return false;
+		}
+		return true;
+	default:
+		return true;
+	}
+}
+
+/// Kind of single column field, messages and unions are expanded into several columns by compile
+inline tll::result_t<op_t::Kind> kind(const tll::scheme::Field *field)
+{
+	using tll::scheme::Field;
+	switch (field->type) {
+	case Field::Int8: return op_t::Int8;
+	case Field::Int16: return op_t::Int16;
+	case Field::Int32: return op_t::Int32;
+	case Field::Int64: return op_t::Int64;
+	case Field::UInt8: return op_t::UInt8;
+	case Field::UInt16: return op_t::UInt16;
+	case Field::UInt32: return op_t::UInt32;
+	case Field::UInt64: return op_t::UInt64;
+	case Field::Double: return op_t::Double;
+	case Field::Decimal128: return op_t::Blob;
+	case Field::Bytes:
+		if (field->sub_type == Field::ByteString)
+			return op_t::String;
+		return op_t::Blob;
+	case Field::Message: return tll::error("Nested message can not be stored in single column");
+	case Field::Array:
+		if (!fixed(field->type_array))
+			return tll::error("Arrays with pointers not supported");
+		return op_t::Blob;
+	case Field::Pointer:
+		if (field->type_ptr->type == Field::Int8 && field->sub_type == Field::ByteString)
+			return op_t::PtrString;
+		return tll::error("Nested arrays not supported");
+	case Field::Union: return tll::error("Union can not be stored in single column");
+	}
+	return tll::error("Invalid field type");
+}
+
+/// SQL type of column for operation
+inline std::string_view sql_type(const op_t &op)
+{
+	if (op.compress)
+		return "BLOB";
+	switch (op.kind) {
+	case op_t::Double: return "REAL";
+	case op_t::String:
+	case op_t::PtrString: return "VARCHAR";
+	case op_t::Blob: return "BLOB";
+	default: return "INTEGER";
+	}
+}
+
+/// Append operations for message fields, nested messages are flattened.
+/// Filter is applied to leaf fields.
+template <typename F>
+inline int compile(plan_t &plan, const tll::scheme::Message *msg, unsigned base, const std::string &prefix, F &filter, std::string &error)
+{
+	using tll::scheme::Field;
+	for (auto f = msg->fields; f; f = f->next) {
+		const unsigned offset = base + f->offset;
+		auto name = prefix + f->name;
+		if (f->type == Field::Message) {
+			if (compile(plan, f->type_msg, offset, name + ".", filter, error))
+				return EINVAL;
+			continue;
+		}
+		if (!filter(f))
+			continue;
+		if (f->type == Field::Union) {
+			// Tag column and payload as fixed size blob
+			auto tag = f->type_union->tag_field;
+			if (!fixed(f)) {
+				error = fmt::format("Field {}: Union with pointers not supported", name);
+				return EINVAL;
+			}
+			auto k = kind(tag);
+			if (!k) {
+				error = fmt::format("Field {}: union tag: {}", name, k.error());
+				return EINVAL;
+			}
+			const unsigned tag_end = tag->offset + tag->size;
+			plan.push_back(op_t { *k, (unsigned) (offset + tag->offset), (unsigned) tag->size, f, name + "._tag" });
+			plan.push_back(op_t { op_t::Blob, offset + tag_end, (unsigned) (f->size - tag_end), f, name });
+			continue;
+		}
+		auto k = kind(f);
+		if (!k) {
+			error = fmt::format("Field {}: {}", name, k.error());
+			return EINVAL;
+		}
+		plan.push_back(op_t { *k, offset, (unsigned) f->size, f, name });
+	}
+	return 0;
+}
+
+/// Compile plan for fields accepted by filter
+template <typename F>
+inline tll::result_t<plan_t> compile(const tll::scheme::Message *msg, F filter)
+{
+	plan_t plan;
+	std::string error;
+	if (compile(plan, msg, 0, "", filter, error))
+		return tll::error(error);
+	return plan;
+}
+
+inline tll::result_t<plan_t> compile(const tll::scheme::Message *msg)
+{
+	return compile(msg, [](auto) { return true; });
+}
+
+template <typename I>
+inline I load(const char * ptr)
+{
+	I v;
+	memcpy(&v, ptr, sizeof(v));
+	return v;
+}
+
+template <typename I>
+inline void store(unsigned char * ptr, I v)
+{
+	memcpy(ptr, &v, sizeof(v));
+}
+
+/// Bind compressed data, buffer is reused so data is copied by sqlite
+inline int bind_compressed(sqlite3_stmt * sql, int idx, const op_t &op, std::string_view data)
+{
+	static thread_local std::vector<unsigned char> buf;
+	if (op.compress->compress(data, buf))
+		return SQLITE_ERROR;
+	return sqlite3_bind_blob(sql, idx, buf.data(), buf.size(), SQLITE_TRANSIENT);
+}
+
+/// Bind message fields as statement parameters starting from index base
+inline int bind(sqlite3_stmt * sql, int base, const plan_t &plan, const tll_msg_t *msg)
+{
+	auto data = static_cast<const char *>(msg->data);
+	int idx = base;
+	for (auto & op : plan) {
+		auto ptr = data + op.offset;
+		int r = SQLITE_OK;
+		switch (op.kind) {
+		case op_t::Int8: r = sqlite3_bind_int64(sql, idx, load<int8_t>(ptr)); break;
+		case op_t::Int16: r = sqlite3_bind_int64(sql, idx, load<int16_t>(ptr)); break;
+		case op_t::Int32: r = sqlite3_bind_int64(sql, idx, load<int32_t>(ptr)); break;
+		case op_t::Int64: r = sqlite3_bind_int64(sql, idx, load<int64_t>(ptr)); break;
+		case op_t::UInt8: r = sqlite3_bind_int64(sql, idx, load<uint8_t>(ptr)); break;
+		case op_t::UInt16: r = sqlite3_bind_int64(sql, idx, load<uint16_t>(ptr)); break;
+		case op_t::UInt32: r = sqlite3_bind_int64(sql, idx, load<uint32_t>(ptr)); break;
+		case op_t::UInt64: r = sqlite3_bind_int64(sql, idx, (sqlite3_int64) load<uint64_t>(ptr)); break;
+		case op_t::Double: r = sqlite3_bind_double(sql, idx, load<double>(ptr)); break;
+		case op_t::String:
+			if (op.compress)
+				r = bind_compressed(sql, idx, op, std::string_view(ptr, strnlen(ptr, op.size)));
+			else
+				r = sqlite3_bind_text(sql, idx, ptr, strnlen(ptr, op.size), SQLITE_STATIC);
+			break;
+		case op_t::Blob:
+			if (op.compress)
+				r = bind_compressed(sql, idx, op, std::string_view(ptr, op.size));
+			else
+				r = sqlite3_bind_blob(sql, idx, ptr, op.size, SQLITE_STATIC);
+			break;
+		case op_t::PtrString: {
+			auto view = tll::make_view(*msg).view(op.offset);
+			auto p = tll::scheme::read_pointer(op.field, view);
+			if (!p)
+				return SQLITE_ERROR;
+			std::string_view string;
+			if (p->size) {
+				if (op.offset + p->offset + p->size > msg->size)
+					return SQLITE_RANGE;
+				string = std::string_view(ptr + p->offset, p->size - 1);
+			}
+			if (op.compress)
+				r = bind_compressed(sql, idx, op, string);
+			else
+				r = sqlite3_bind_text(sql, idx, string.size() ? string.data() : "", string.size(), SQLITE_STATIC);
+			break;
+		}
+		}
+		if (r != SQLITE_OK)
+			return r;
+		idx++;
+	}
+	return SQLITE_OK;
+}
+
+/// Compressed value of column, empty if column is not compressed or row is stored as plain text
+inline std::optional<std::string_view> compressed(sqlite3_stmt * sql, int idx, const op_t &op)
+{
+	if (!op.compress || sqlite3_column_type(sql, idx) != SQLITE_BLOB)
+		return std::nullopt;
+	auto data = (const char *) sqlite3_column_blob(sql, idx);
+	return std::string_view(data ? data : "", sqlite3_column_bytes(sql, idx));
+}
+
+/// Size of decompressed value, -1 if data is invalid
+inline long long decompressed_size(const op_t &op, std::string_view data)
+{
+	return data.empty() ? 0 : op.compress->size(data);
+}
+
+/// Decompress value into buffer of at most limit bytes
+inline int decompress(const op_t &op, std::string_view data, unsigned char * ptr, size_t limit)
+{
+	auto size = decompressed_size(op, data);
+	if (size < 0 || (size_t) size > limit)
+		return EMSGSIZE;
+	if (size == 0)
+		return 0;
+	return op.compress->decompress(data, ptr, size);
+}
+
+/// Fill message body from result columns starting from index base, pointer data is appended to the buffer.
+/// Text lengths are taken from sqlite3_column_bytes, strings are not scanned. Buffer is grown once for
+/// all pointer data of the row, its capacity is kept between rows. Compressed columns are decompressed
+/// in place, rows written before compression was enabled are read as is.
+inline int column(sqlite3_stmt * sql, int base, const plan_t &plan, std::vector<unsigned char> &buf)
+{
+	size_t extra = 0;
+	for (auto i = 0u; i < plan.size(); i++) {
+		if (plan[i].kind != op_t::PtrString)
+			continue;
+		if (auto z = compressed(sql, base + i, plan[i]); z) {
+			auto size = decompressed_size(plan[i], *z);
+			if (size < 0)
+				return EINVAL;
+			extra += size + 1;
+			continue;
+		}
+		// Text is requested first so size is given for UTF-8 representation
+		sqlite3_column_text(sql, base + i);
+		extra += sqlite3_column_bytes(sql, base + i) + 1;
+	}
+	auto off = buf.size();
+	buf.resize(off + extra);
+
+	int idx = base;
+	for (auto & op : plan) {
+		auto ptr = buf.data() + op.offset;
+		switch (op.kind) {
+		case op_t::Int8: store<int8_t>(ptr, sqlite3_column_int64(sql, idx)); break;
+		case op_t::Int16: store<int16_t>(ptr, sqlite3_column_int64(sql, idx)); break;
+		case op_t::Int32: store<int32_t>(ptr, sqlite3_column_int64(sql, idx)); break;
+		case op_t::Int64: store<int64_t>(ptr, sqlite3_column_int64(sql, idx)); break;
+		case op_t::UInt8: store<uint8_t>(ptr, sqlite3_column_int64(sql, idx)); break;
+		case op_t::UInt16: store<uint16_t>(ptr, sqlite3_column_int64(sql, idx)); break;
+		case op_t::UInt32: store<uint32_t>(ptr, sqlite3_column_int64(sql, idx)); break;
+		case op_t::UInt64: store<uint64_t>(ptr, (uint64_t) sqlite3_column_int64(sql, idx)); break;
+		case op_t::Double: store<double>(ptr, sqlite3_column_double(sql, idx)); break;
+		case op_t::String: {
+			if (auto z = compressed(sql, idx, op); z) {
+				if (decompress(op, *z, ptr, op.size))
+					return EINVAL;
+				break;
+			}
+			auto string = sqlite3_column_text(sql, idx);
+			if (string)
+				memcpy(ptr, string, std::min<size_t>(sqlite3_column_bytes(sql, idx), op.size));
+			break;
+		}
+		case op_t::Blob: {
+			if (auto z = compressed(sql, idx, op); z) {
+				if (decompress(op, *z, ptr, op.size))
+					return EINVAL;
+				break;
+			}
+			auto blob = sqlite3_column_blob(sql, idx);
+			if (blob)
+				memcpy(ptr, blob, std::min<size_t>(sqlite3_column_bytes(sql, idx), op.size));
+			break;
+		}
+		case op_t::PtrString: {
+			auto z = compressed(sql, idx, op);
+			std::string_view string;
+			if (!z) {
+				auto text = (const char *) sqlite3_column_text(sql, idx);
+				if (text)
+					string = std::string_view(text, sqlite3_column_bytes(sql, idx));
+			}
+			const size_t size = z ? decompressed_size(op, *z) : string.size();
+			tll::scheme::generic_offset_ptr_t p;
+			p.size = size + 1;
+			p.offset = off - op.offset;
+			p.entity = 1;
+			auto view = tll::make_view(buf).view(op.offset);
+			tll::scheme::write_pointer(op.field, view, p);
+			if (z) {
+				if (decompress(op, *z, buf.data() + off, size))
+					return EINVAL;
+			} else
+				memcpy(buf.data() + off, string.data(), string.size());
+			buf[off + size] = '\0';
+			off += size + 1;
+			break;
+		}
+		}
+		idx++;
+	}
+	return 0;
+}
+}
+
+#endif//_BIND_H
@@ -7,6 +7,13 @@
 
 #include <sqlite3.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <variant>
 
 #include "tll/channel/base.h"
@@ -16,19 +23,158 @@
 #include "tll/util/memoryview.h"
 #include "tll/util/string.h"
 
+#include "bind.h"
 #include "common.h"
+#include "msgid-map.h"
+#include "ring.h"
 #include "sqlite-scheme.h"
 
 using namespace tll;
 
 class SQLite : public SQLBase<SQLite>
 {
-	std::map<int, std::pair<const tll::scheme::Message *, query_ptr_t>> _messages;
+	/// Message staged for multi-row insert
+	struct staged_t
+	{
+		long long seq;
+		size_t offset;
+		size_t size;
+	};
+
+	struct message_t
+	{
+		const tll::scheme::Message * message = nullptr;
+		std::string table;
+		query_ptr_t insert;
+		sqlite_bind::plan_t plan;
+
+		bool blob = false; ///< Message body is stored in _tll_data column, plan holds only key fields
+
+		size_t rows = 1; ///< Number of rows in bulk insert statement
+		size_t inserted = 0; ///< Rows inserted since open, stat page has fixed layout so they are logged on close
+		query_ptr_t insert_bulk;
+		std::vector<char> staged_data;
+		std::vector<staged_t> staged;
+
+		/// Insert statements are prepared on first use
+		std::string insert_sql;
+		std::string insert_bulk_sql;
+
+		/// Number of statement parameters per row
+		int columns() const { return plan.size() + 1 + (blob ? 1 : 0); }
+	};
+
+	MsgidMap<message_t> _messages;
 
 	bool _replace = false;
+	bool _upsert = false; ///< Update existing rows by primary key only if they are changed
+	size_t _rows_per_statement = 1;
+
+	enum class Storage { Columns, Blob };
+	Storage _storage = Storage::Columns;
+
+	enum class SeqKey { Index, RowId };
+	SeqKey _seq_key = SeqKey::Index; ///< Layout of seq column: separate index or rowid alias
+	bool _without_rowid = false;
+
+	/// Select of previously read message: parked statement and plan with codecs, reused on TableName switch
+	struct select_cache_t
+	{
+		query_ptr_t statement;
+		sqlite_bind::plan_t plan;
+		bool blob = false;
+		std::string columns; ///< Select clause without conditions
+	};
 
 	query_ptr_t _select_statement = nullptr;
+	MsgidMap<select_cache_t> _select_cache;
 	const tll::scheme::Message * _select_message = nullptr;
+	sqlite_bind::plan_t _select_plan;
+	bool _select_blob = false;
+	std::vector<unsigned char> _select_buf;
+	std::optional<long long> _select_seq;
+	std::optional<long long> _select_seq_end;
+	std::optional<long long> _select_limit;
+	std::optional<long long> _select_last; ///< Seq of last emitted row
+	bool _select_active = false; ///< Read is started and EndOfData is not reached yet
+
+	bool _follow = false;
+	bool _follow_wait = false; ///< All rows are read, waiting for new data
+	bool _follow_eod = false; ///< EndOfData is already sent
+	tll::duration _follow_interval = {};
+	std::unique_ptr<tll::Channel> _follow_timer;
+	query_ptr_t _data_version;
+	long long _data_version_last = 0;
+	unsigned _batch = 1;
+	tll::duration _batch_time = {};
+
+	/// Message header stored in async ring, followed by message body
+	struct async_header_t
+	{
+		int16_t type;
+		int32_t msgid;
+		int64_t seq;
+	};
+
+	bool _async = false;
+	enum class AsyncFull { Block, EAgain } _async_full = AsyncFull::Block;
+	size_t _async_size = 0;
+	static constexpr size_t async_size_min = 1024; ///< Ring must hold at least several record headers
+	SPSCRing _async_ring;
+	std::thread _async_thread;
+	std::atomic<bool> _async_stop = false;
+	std::atomic<int> _async_error = 0;
+	std::atomic<bool> _async_sleep = false;
+	std::mutex _async_lock;
+	std::condition_variable _async_cond;
+
+	/// Message routing in sharded writer, by key field if it is present or by msgid
+	struct shard_route_t
+	{
+		const tll::scheme::Message * message = nullptr;
+		std::optional<sqlite_bind::op_t> key;
+	};
+
+	/// Shard database in sharded reader or table in multi-table reader with statement positioned on current row
+	struct shard_cursor_t
+	{
+		std::shared_ptr<sqlite3> db;
+		query_ptr_t select;
+		long long seq = 0;
+		const tll::scheme::Message * message = nullptr;
+		sqlite_bind::plan_t plan;
+		bool blob = false;
+	};
+
+	unsigned _shards = 0;
+	std::vector<std::unique_ptr<tll::Channel>> _shard_writers;
+	MsgidMap<shard_route_t> _shard_routes;
+	std::vector<shard_cursor_t> _shard_cursors;
+	std::vector<unsigned> _shard_heap; ///< Cursors with pending row ordered by seq
+	long long _shard_rows = 0; ///< Number of rows emitted by sharded reader
+
+	/// Seq range of parallel reader, scanned by separate thread into its own ring
+	struct partition_t
+	{
+		long long begin = 0;
+		long long end = 0;
+		SPSCRing ring;
+		std::thread thread;
+		std::atomic<bool> done = false;
+		std::atomic<bool> error = false;
+		bool finished = false; ///< All rows are emitted, used only from processing thread
+	};
+
+	unsigned _parallel = 0;
+	bool _ordered = true;
+	bool _parallel_active = false;
+	std::atomic<bool> _parallel_stop = false;
+	std::string _select_table;
+	std::string _partition_select;
+	std::vector<std::unique_ptr<partition_t>> _partitions;
+	size_t _partition_current = 0;
+	size_t _partition_left = 0;
+	long long _parallel_rows = 0; ///< Number of rows emitted by parallel reader
 
  public:
 	static constexpr std::string_view sqlite_control_scheme() { return sqlite_scheme::scheme; }
@@ -43,13 +189,69 @@ class SQLite : public SQLBase<SQLite>
 	int _post(const tll_msg_t *msg, int flags);
 	int _process(long timeout, int flags);
 
+	int _on_commit();
+
  private:
-	int _create_table(std::string_view table, const tll::scheme::Message *);
-	int _create_statement(std::string_view table, const tll::scheme::Message *);
+	/// Plan of insert statement with codecs attached, only key fields in blob storage mode
+	int _insert_plan(const tll::scheme::Message *, sqlite_bind::plan_t &, bool &blob);
+	int _create_table(std::string_view table, const tll::scheme::Message *, const sqlite_bind::plan_t &, bool blob, std::set<std::string, std::less<>> &tables);
+	int _create_statement(std::string_view table, const tll::scheme::Message *, sqlite_bind::plan_t &&, bool blob);
+	int _prepare_statement(message_t &);
 	int _create_index(const std::string_view &name, std::string_view key, bool unique);
 	int _create_select_statement(std::string_view _table);
+	tll::result_t<std::string> _select_columns(std::string_view table, const tll::scheme::Message *, sqlite_bind::plan_t &, bool &blob);
+	/// Cache entry of message, plan and select clause are compiled on first use
+	select_cache_t * _select_cached(std::string_view table, const tll::scheme::Message *);
+	/// ORDER BY clause for select, empty if rows are streamed in rowid order. Fails if read needs sorted rows
+	/// and seq is not indexed, otherwise whole table would be sorted before first row is emitted
+	tll::result_t<std::string_view> _select_order(std::string_view table, const tll::scheme::Message *, bool merge);
+	void _select_bind(sqlite3_stmt *);
+	void _select_park();
+	/// Finish read after EndOfData: statements are reset to release read transaction,
+	/// connection and statement cache are kept so next table can be selected with TableName
+	void _select_finish();
+
+	const tll::scheme::Message * _table_lookup(std::string_view table);
+	const tll::scheme::Message * _message_lookup(int msgid);
+
+	int _process_row();
+	int _emit_row(sqlite3_stmt * sql) { return _emit_row(sql, _select_message, _select_plan, _select_blob); }
+	int _emit_row(sqlite3_stmt *, const tll::scheme::Message *, const sqlite_bind::plan_t &, bool blob);
+	int _select_start();
+	int _data_version_get(long long &);
+	int _on_follow_timer(const tll::Channel *, const tll_msg_t *);
+	int _last_seq(const tll_msg_t *msg);
+
+	tll::result_t<bool> _blob_storage(const tll::scheme::Message *msg);
+	int _bind(const message_t &, sqlite3_stmt *, int idx, const tll_msg_t *msg);
+
+	int _post_data(const tll_msg_t *msg);
+	int _post_staged(message_t &, const tll_msg_t *msg);
+	int _post_async(const tll_msg_t *msg);
+	void _async_run();
+
+	int _shards_open(std::string_view table);
+	int _merge_open(std::string_view tables);
+	int _shard_step(unsigned idx);
+	int _process_shard_row();
+	int _post_shard(const tll_msg_t *msg);
+
+	int _partitions_start();
+	void _partitions_stop();
+	void _partition_run(partition_t *);
+	int _process_partition_row();
 };
 
+namespace {
+
+/// Table of the message, name of the message if sql.table option is not set
+std::string_view message_table(const tll::scheme::Message &m)
+{
+	return tll::getter::get(m.options, "sql.table").value_or(std::string_view(m.name));
+}
+
+}
+
 int SQLite::_init(const Channel::Url &url, Channel * master)
 {
 	if ((internal.caps & (caps::Input | caps::Output)) == caps::Input)
@@ -58,51 +260,176 @@ int SQLite::_init(const Channel::Url &url, Channel * master)
 	auto reader = channel_props_reader(url);
 
 	_replace = reader.getT("replace", false);
+	_upsert = reader.getT("upsert", false);
+	_rows_per_statement = reader.getT("rows-per-statement", 1u);
+	_storage = reader.getT("storage", Storage::Columns, {{"columns", Storage::Columns}, {"blob", Storage::Blob}});
+	_seq_key = reader.getT("seq-key", SeqKey::Index, {{"index", SeqKey::Index}, {"rowid", SeqKey::RowId}});
+	_without_rowid = reader.getT("without-rowid", false);
+	_batch = reader.getT("batch", 1u);
+	_batch_time = reader.getT("batch-time", tll::duration {});
+	_follow = reader.getT("follow", false);
+	_follow_interval = reader.getT("follow-interval", tll::duration { std::chrono::milliseconds(100) });
+	_async = reader.getT("async", false);
+	_async_full = reader.getT("async-full", AsyncFull::Block, {{"block", AsyncFull::Block}, {"eagain", AsyncFull::EAgain}});
+	_async_size = reader.getT("async-size", tll::util::Size { 16 * 1024 * 1024 });
+	_shards = reader.getT("shards", 0u);
+	_parallel = reader.getT("parallel", 0u);
+	_ordered = reader.getT("ordered", true);
 	if (!reader)
 		return _log.fail(EINVAL, "Invalid url: {}", reader.error());
 
-	return SQLBase<SQLite>::_init(url, master);
+	if (_rows_per_statement == 0)
+		return _log.fail(EINVAL, "Invalid rows-per-statement parameter: 0");
+	if (_replace && _upsert)
+		return _log.fail(EINVAL, "Parameters replace and upsert are mutually exclusive");
+	if (_parallel > 1 && (_follow || _shards))
+		return _log.fail(EINVAL, "Parallel reader can not be used with follow mode or shards");
+	if (_batch == 0)
+		return _log.fail(EINVAL, "Invalid batch parameter: 0");
+	if (_async_size < async_size_min)
+		return _log.fail(EINVAL, "Invalid async-size {}: less than minimal {}", _async_size, async_size_min);
+
+	// Async writer thread checks bulk interval, sharded channel has no transaction of its own
+	_bulk_thread = _async || _shards;
+	if (auto r = SQLBase<SQLite>::_init(url, master); r)
+		return r;
+	if ((_async || _shards) && _busy_policy != BusyPolicy::Fail)
+		return _log.fail(EINVAL, "Non-blocking busy policy can not be used with async writer or shards");
+
+	_shard_writers.clear();
+	if (_shards) {
+		if (_async)
+			return _log.fail(EINVAL, "Sharded channel always uses async shard writers, async parameter is not allowed");
+		if (_follow)
+			return _log.fail(EINVAL, "Follow mode is not supported with shards");
+		for (auto i = 0u; i < _shards; i++) {
+			auto curl = url.copy();
+			curl.set("tll.host", fmt::format("{}.{}", _path, i));
+			curl.set("name", fmt::format("{}/shard/{}", self()->name(), i));
+			curl.set("tll.internal", "yes");
+			curl.set("shards", "0");
+			curl.set("async", "yes");
+			auto c = context().channel(curl, self());
+			if (!c)
+				return _log.fail(EINVAL, "Failed to create shard {} writer", i);
+			_child_add(c.get(), fmt::format("shard/{}", i));
+			_shard_writers.push_back(std::move(c));
+		}
+	}
+
+	if (_follow) {
+		_follow_timer = _timer_create("follow-timer", _follow_interval);
+		if (!_follow_timer)
+			return _log.fail(EINVAL, "Failed to create follow timer");
+		_follow_timer->callback_add<SQLite, &SQLite::_on_follow_timer>(this, TLL_MESSAGE_MASK_DATA);
+	}
+
+	if (_rows_per_statement > 1 && _bulk_size && _bulk_size < _rows_per_statement)
+		_log.warning("Bulk size {} is less than rows-per-statement {}, multi-row inserts are not used", _bulk_size, _rows_per_statement);
+	return 0;
 }
 
 int SQLite::_open(const ConstConfig &s)
 {
+	auto table_name = s.get("table");
+
+	_select_seq.reset();
+	_select_seq_end.reset();
+	_select_limit.reset();
+	for (auto & [k, v] : std::initializer_list<std::pair<std::string_view, std::optional<long long> &>> {{"seq", _select_seq}, {"seq-end", _select_seq_end}, {"limit", _select_limit}}) {
+		auto str = s.get(k);
+		if (!str)
+			continue;
+		auto r = conv::to_any<long long>(*str);
+		if (!r)
+			return _log.fail(EINVAL, "Invalid {} parameter '{}': {}", k, *str, r.error());
+		v = *r;
+	}
+
+	if (_shards)
+		return _shards_open(table_name ? *table_name : "");
+
 	if (auto r = SQLBase<SQLite>::_open(s); r)
 		return _log.fail(r, "Failed to open SQLite database");
 
-	auto table_name = s.get("table");
+	std::set<std::string, std::less<>> tables;
+	{
+		query_ptr_t sql;
+		sql.reset(_prepare("SELECT name FROM sqlite_master WHERE type='table'"));
+		if (!sql)
+			return _log.fail(EINVAL, "Failed to prepare table list statement");
+		int r = SQLITE_ROW;
+		while ((r = sqlite3_step(sql.get())) == SQLITE_ROW)
+			tables.emplace((const char *) sqlite3_column_text(sql.get(), 0), sqlite3_column_bytes(sql.get(), 0));
+		if (r != SQLITE_DONE)
+			return _log.fail(EINVAL, "Failed to list tables: {}", sqlite3_errmsg(_db.get()));
+	}
 
+	// All DDL is done in one transaction, insert statements are prepared on first use
+	if (sqlite3_exec(_db.get(), "BEGIN", 0, 0, 0))
+		return _log.fail(EINVAL, "Failed to begin transaction: {}", sqlite3_errmsg(_db.get()));
 	for (auto & m : tll::util::list_wrap(_scheme->messages)) {
 		if (m.msgid == 0) {
 			_log.debug("Message {} has no msgid, skip table check", m.name);
 			continue;
 		}
 
-		auto table = tll::getter::get(m.options, "sql.table").value_or(std::string_view(m.name));
+		auto table = message_table(m);
 
-		if (_create_table(table, &m))
+		sqlite_bind::plan_t plan;
+		bool blob = false;
+		if (_insert_plan(&m, plan, blob) || _create_table(table, &m, plan, blob, tables) || _create_statement(table, &m, std::move(plan), blob)) {
+			sqlite3_exec(_db.get(), "ROLLBACK", 0, 0, 0);
 			return _log.fail(EINVAL, "Failed to create table '{}' for '{}'", table, m.name);
-		if (_create_statement(table, &m))
-			return _log.fail(EINVAL, "Failed to prepare SQL statement for '{}'", m.name);
+		}
 	}
+	if (sqlite3_exec(_db.get(), "COMMIT", 0, 0, 0))
+		return _log.fail(EINVAL, "Failed to commit schema changes: {}", sqlite3_errmsg(_db.get()));
 
 	if (table_name && table_name->size()) {
+		if (_async)
+			return _log.fail(EINVAL, "Reading is not supported in async mode");
 		std::string_view tname = *table_name;
-		for (auto& m : _messages) {
-			const auto& options = m.second.first->options;
-			const auto& name = m.second.first->name;
-			if (tname == tll::getter::get(options, "sql.table").value_or(std::string_view(name))) {
-				_select_message = m.second.first;
-			}
-		}
+		if (tname.find(',') != tname.npos)
+			return _merge_open(tname);
+		_select_message = _table_lookup(tname);
+		if (!_select_message)
+			return _log.fail(ENOENT, "Table '{}' not found in scheme", tname);
 		if (_create_select_statement(tname)) {
 			return EINVAL;
 		}
-		_update_dcaps(dcaps::Process | dcaps::Pending);
+		if (_select_start())
+			return EINVAL;
+	}
+
+	if (_async) {
+		_async_ring.resize(_async_size);
+		_async_stop = false;
+		_async_error = 0;
+		_async_thread = std::thread(&SQLite::_async_run, this);
 	}
 
 	return 0;
 }
 
+const tll::scheme::Message * SQLite::_table_lookup(std::string_view table)
+{
+	for (auto & m : tll::util::list_wrap(_scheme->messages)) {
+		if (m.msgid && table == message_table(m))
+			return &m;
+	}
+	return nullptr;
+}
+
+const tll::scheme::Message * SQLite::_message_lookup(int msgid)
+{
+	for (auto & m : tll::util::list_wrap(_scheme->messages)) {
+		if (m.msgid == msgid)
+			return &m;
+	}
+	return nullptr;
+}
+
 namespace {
 
 template <typename Iter>
@@ -125,187 +452,137 @@ std::string join(const Iter &begin, const Iter &end)
 	return join(", ", begin, end);
 }
 
-tll::result_t<std::string> sql_type(const tll::scheme::Field *field)
-{
-	using tll::scheme::Field;
-	switch (field->type) {
-	case Field::Int8:
-	case Field::UInt8:
-	case Field::Int16:
-	case Field::UInt16:
-	case Field::Int32:
-	case Field::UInt32:
-	case Field::Int64:
-		return "INTEGER";
-	case Field::UInt64:
-		return tll::error("UInt64 not supported");
-
-	case Field::Double:
-		return "REAL";
-
-	case Field::Decimal128:
-		return tll::error("Decimal128 not supported yet");
-		//return "REAL";
-
-	case Field::Bytes:
-		if (field->sub_type == Field::ByteString)
-			return "VARCHAR";
-		return "REAL";
-
-	case Field::Message:
-		return tll::error("Nested messages not supported");
-	case Field::Array:
-		return tll::error("Nested arrays not supported");
-	case Field::Pointer:
-		if (field->type_ptr->type == Field::Int8 && field->sub_type == Field::ByteString) {
-			return "VARCHAR";
-		}
-		return tll::error("Nested arrays not supported");
-	case Field::Union:
-		return tll::error("Union not supported");
-	}
-	return tll::error("Invalid field type");
-}
-
-template <typename Buf>
-int sql_bind(sqlite3_stmt * sql, int idx, const tll::scheme::Field *field, const Buf &data)
-{
-	using tll::scheme::Field;
-	switch (field->type) {
-	case Field::Int8:
-	case Field::Int16:
-	case Field::Int32:
-	case Field::Int64:
-	case Field::UInt8:
-	case Field::UInt16:
-	case Field::UInt32:
-		return sqlite3_bind_int64(sql, idx, tll::scheme::read_size(field, data));
-
-	case Field::Double:
-		return sqlite3_bind_double(sql, idx, *data.template dataT<double>());
-
-	case Field::UInt64:
-	case Field::Decimal128:
-		return SQLITE_ERROR;
-
-	case Field::Bytes:
-		if (field->sub_type == Field::ByteString) {
-			auto str = data.template dataT<char>();
-			return sqlite3_bind_text(sql, idx, str, strnlen(str, field->size), SQLITE_STATIC);
-		}
-
-		return sqlite3_bind_blob(sql, idx, data.data(), field->size, SQLITE_STATIC);
-
-	case Field::Message:
-		return SQLITE_ERROR;
-	case Field::Array:
-		return SQLITE_ERROR;
-	case Field::Pointer:
-		if (field->type_ptr->type == Field::Int8 && field->sub_type == Field::ByteString) {
-			auto ptr = tll::scheme::read_pointer(field, data);
-			if (!ptr)
-				return SQLITE_ERROR;
-			if (ptr->size == 0)
-				return sqlite3_bind_text(sql, idx, "", 0, SQLITE_STATIC);
-			return sqlite3_bind_text(sql, idx, data.view(ptr->offset).template dataT<char>(), ptr->size - 1, SQLITE_STATIC);
-		}
-		return SQLITE_ERROR;
-	case Field::Union:
-		return SQLITE_ERROR;
-	}
-	return SQLITE_ERROR;
-}
-
-template <typename Buf>
-int sql_column_(sqlite3_stmt * sql, int idx, const tll::scheme::Field *field, Buf data)
-{
-	using tll::scheme::Field;
-	switch (field->type) {
-	case Field::Int8:
-		*data.template dataT<int8_t>() = sqlite3_column_int64(sql, idx);
-		return 0;
-	case Field::Int16:
-		*data.template dataT<int16_t>() = sqlite3_column_int64(sql, idx);
-		return 0;
-	case Field::Int32:
-		*data.template dataT<int32_t>() = sqlite3_column_int64(sql, idx);
-		return 0;
-	case Field::Int64:
-		*data.template dataT<int64_t>() = sqlite3_column_int64(sql, idx);
-		return 0;
-	case Field::UInt8:
-		*data.template dataT<uint8_t>() = sqlite3_column_int64(sql, idx);
-		return 0;
-	case Field::UInt16:
-		*data.template dataT<uint16_t>() = sqlite3_column_int64(sql, idx);
-		return 0;
-	case Field::UInt32:
-		*data.template dataT<uint32_t>() = sqlite3_column_int64(sql, idx);
-		return 0;
-	case Field::Double:
-		*data.template dataT<double>() = sqlite3_column_double(sql, idx);
-		return 0;
-	case Field::Decimal128:
-		return SQLITE_ERROR;
+bool primary_key(const tll::scheme::Field *f)
+{
+	auto pkey = tll::getter::getT(f->options, "sql.primary-key", false);
+	if (f->type == f->Pointer)
+		pkey = tll::getter::getT(f->type_ptr->options, "sql.primary-key", false);
+	return pkey && *pkey;
+}
 
-	case Field::Bytes: {
-		if (field->sub_type == Field::ByteString) {
-			auto string = (const char*) sqlite3_column_text(sql, idx);
-			memcpy(data.template dataT<char>(), string, std::min(strlen(string), field->size));
-			return 0;
+/// Primary key and indexed fields are kept as separate columns in blob storage mode
+bool key_field(const tll::scheme::Field *f)
+{
+	if (primary_key(f))
+		return true;
+	auto index = tll::getter::get(f->options, "sql.index");
+	return index && *index != "no";
+}
+
+/// Attach codecs to operations of fields with sql.compress option
+int compress_plan(sqlite_bind::plan_t &plan, std::string &error)
+{
+	using sqlite_bind::op_t;
+	for (auto & op : plan) {
+		auto & f = *op.field;
+		auto codec = tll::getter::get(f.options, "sql.compress");
+		if (!codec || *codec == "no")
+			continue;
+		if (f.type == f.Union || (op.kind != op_t::String && op.kind != op_t::Blob && op.kind != op_t::PtrString)) {
+			error = fmt::format("Field {}: compression is supported only for string and blob fields", op.name);
+			return EINVAL;
+		}
+		if (key_field(&f)) {
+			error = fmt::format("Field {}: compressed field can not be primary key or indexed", op.name);
+			return EINVAL;
+		}
+		auto level = tll::getter::getT(f.options, "sql.compress-level", 0);
+		if (!level) {
+			error = fmt::format("Field {}: invalid sql.compress-level option: {}", op.name, level.error());
+			return EINVAL;
+		}
+		auto dict = tll::getter::get(f.options, "sql.compress-dict").value_or(std::string_view());
+		op.compress = sqlite_compress::create(*codec, *level, dict, error);
+		if (!op.compress) {
+			error = fmt::format("Field {}: {}", op.name, error);
+			return EINVAL;
 		}
-		auto b_string = (sqlite3_column_blob(sql, idx));
-		memcpy(data.data(), b_string, field->size);
-		return 0;
 	}
-	case Field::Pointer: {
-		if (field->type_ptr->type == Field::Int8 && field->sub_type == Field::ByteString) {
-			auto string = std::string_view((const char*) sqlite3_column_text(sql, idx));
-			tll::scheme::generic_offset_ptr_t ptr;
-			ptr.size = string.size() + 1;
-			ptr.offset = data.size();
-			ptr.entity = 1;
-			data.resize(data.size() + string.size() + 1);
-			write_pointer(field, data, ptr);
-			memcpy(data.view(ptr.offset).template dataT<char>(), string.data(), string.size() + 1);
+	return 0;
+}
+
+/// Hash of key field value used to select shard
+size_t shard_hash(const sqlite_bind::op_t &op, const tll_msg_t *msg)
+{
+	using sqlite_bind::op_t;
+	using sqlite_bind::load;
+	auto ptr = static_cast<const char *>(msg->data) + op.offset;
+	uint64_t v = 0;
+	switch (op.kind) {
+	case op_t::Int8: v = load<int8_t>(ptr); break;
+	case op_t::Int16: v = load<int16_t>(ptr); break;
+	case op_t::Int32: v = load<int32_t>(ptr); break;
+	case op_t::Int64: v = load<int64_t>(ptr); break;
+	case op_t::UInt8: v = load<uint8_t>(ptr); break;
+	case op_t::UInt16: v = load<uint16_t>(ptr); break;
+	case op_t::UInt32: v = load<uint32_t>(ptr); break;
+	case op_t::UInt64: v = load<uint64_t>(ptr); break;
+	case op_t::Double: v = load<uint64_t>(ptr); break;
+	case op_t::String: return std::hash<std::string_view> {}(std::string_view(ptr, strnlen(ptr, op.size)));
+	case op_t::Blob: return std::hash<std::string_view> {}(std::string_view(ptr, op.size));
+	case op_t::PtrString: {
+		auto p = tll::scheme::read_pointer(op.field, tll::make_view(*msg).view(op.offset));
+		if (!p || p->size == 0 || op.offset + p->offset + p->size > msg->size)
 			return 0;
-		}
-		return SQLITE_ERROR;
+		return std::hash<std::string_view> {}(std::string_view(ptr + p->offset, p->size - 1));
 	}
-	default:
-		return SQLITE_ERROR;
 	}
-
-	return SQLITE_ERROR;
+	return (v * 0x9e3779b97f4a7c15ull) >> 32;
 }
 
 }
 
-int SQLite::_create_table(std::string_view table, const tll::scheme::Message * msg)
+tll::result_t<bool> SQLite::_blob_storage(const tll::scheme::Message *msg)
 {
-	query_ptr_t sql;
+	auto storage = tll::getter::getT(msg->options, "sql.storage", _storage, {{"columns", Storage::Columns}, {"blob", Storage::Blob}});
+	if (!storage)
+		return tll::error(fmt::format("Invalid sql.storage option: {}", storage.error()));
+	return *storage == Storage::Blob;
+}
 
-	sql.reset(_prepare("SELECT name FROM sqlite_master WHERE name=?"));
-	if (!sql)
-		return _log.fail(EINVAL, "Failed to prepare check statement");
+int SQLite::_insert_plan(const tll::scheme::Message * msg, sqlite_bind::plan_t &plan, bool &blob)
+{
+	auto b = _blob_storage(msg);
+	if (!b)
+		return _log.fail(EINVAL, "Message {}: {}", msg->name, b.error());
+	blob = *b;
+
+	auto p = blob ? sqlite_bind::compile(msg, key_field) : sqlite_bind::compile(msg);
+	if (!p)
+		return _log.fail(EINVAL, "Failed to compile message {}: {}", msg->name, p.error());
+	plan = std::move(*p);
+	if (std::string error; compress_plan(plan, error))
+		return _log.fail(EINVAL, "Message {}: {}", msg->name, error);
+	return 0;
+}
 
-	sqlite3_bind_text(sql.get(), 1, table.data(), table.size(), SQLITE_STATIC);
-	auto r = sqlite3_step(sql.get());
-	if (r == SQLITE_ROW) {
+int SQLite::_create_table(std::string_view table, const tll::scheme::Message * msg, const sqlite_bind::plan_t &plan, bool blob, std::set<std::string, std::less<>> &tables)
+{
+	if (tables.find(table) != tables.end()) {
 		_log.debug("Table '{}' exists", table);
 		return 0;
-	} else if (r != SQLITE_DONE)
-		return _log.fail(EINVAL, "Failed to check table '{}'", table);
+	}
+	tables.emplace(table);
+
+	query_ptr_t sql;
+
+	auto without_rowid = tll::getter::getT(msg->options, "sql.without-rowid", _without_rowid);
+	if (!without_rowid)
+		return _log.fail(EINVAL, "Invalid sql.without-rowid option for {}: {}", msg->name, without_rowid.error());
 
 	_log.info("Create table '{}'", table);
 	std::list<std::string> fields;
 
-	fields.push_back("`_tll_seq` INTEGER");
-	for (auto & f : tll::util::list_wrap(msg->fields)) {
-		auto t = sql_type(&f);
-		if (!t)
-			return _log.fail(EINVAL, "Message {} field {}: {}", msg->name, f.name, t.error());
-		fields.push_back(fmt::format("`{}` {} NOT NULL", f.name, *t));
+	// Seq is rowid alias, primary key fields of the message become unique constraints
+	const bool rowid = _seq_key == SeqKey::RowId;
+	bool has_key = rowid;
+
+	fields.push_back(rowid ? "`_tll_seq` INTEGER PRIMARY KEY" : "`_tll_seq` INTEGER");
+	for (auto & op : plan) {
+		auto & f = *op.field;
+		fields.push_back(fmt::format("`{}` {} NOT NULL", op.name, sqlite_bind::sql_type(op)));
+		if (f.type == f.Union && op.kind != sqlite_bind::op_t::Blob)
+			continue;
 
 		auto pkey = tll::getter::getT(f.options, "sql.primary-key", false);
 		if (f.type == f.Pointer)
@@ -314,12 +591,19 @@ int SQLite::_create_table(std::string_view table, const tll::scheme::Message * m
 		if (!pkey)
 			_log.warning("Invalid primary-key option: {}", pkey.error());
 		else if (*pkey) {
-			_log.debug("Field {} is primary key", f.name);
-			fields.back() += " PRIMARY KEY";
+			_log.debug("Field {} is primary key", op.name);
+			fields.back() += rowid ? " UNIQUE" : " PRIMARY KEY";
+			has_key = true;
 		}
 	}
+	if (blob)
+		fields.push_back("`_tll_data` BLOB NOT NULL");
 
-	sql.reset(_prepare(fmt::format("CREATE TABLE `{}` ({})", table, join(fields.begin(), fields.end()))));
+	if (*without_rowid && !has_key)
+		return _log.fail(EINVAL, "WITHOUT ROWID table {} needs primary key: mark field with sql.primary-key or use seq-key=rowid", table);
+	std::string_view options = *without_rowid ? " WITHOUT ROWID" : "";
+
+	sql.reset(_prepare(fmt::format("CREATE TABLE `{}` ({}){}", table, join(fields.begin(), fields.end()), options)));
 	if (!sql)
 		return _log.fail(EINVAL, "Failed to prepare CREATE statement");
 
@@ -330,85 +614,381 @@ int SQLite::_create_table(std::string_view table, const tll::scheme::Message * m
 		auto index = tll::getter::getT(msg->options, "sql.index", _seq_index, {{"no", Index::No}, {"yes", Index::Yes}, {"unique", Index::Unique}});
 		if (!index) {
 			_log.warning("Invalid sql.index option for {}: {}", msg->name, index.error());
+		} else if (rowid) {
+			_log.debug("Seq is primary key of table {}, skip seq index", table);
 		} else if (*index != Index::No) {
 			if (_create_index(table, "_tll_seq", *index == Index::Unique))
 				return _log.fail(EINVAL, "Failed to create seq index for table {}", table);
 		}
 	}
 
-	for (auto & f : tll::util::list_wrap(msg->fields)) {
-		auto index = tll::getter::getT(f.options, "sql.index", Index::No, {{"no", Index::No}, {"yes", Index::Yes}, {"unique", Index::Unique}});
+	for (auto & op : plan) {
+		// Union tag shares options with payload column, index only the payload
+		if (op.field->type == op.field->Union && op.kind != sqlite_bind::op_t::Blob)
+			continue;
+		auto index = tll::getter::getT(op.field->options, "sql.index", Index::No, {{"no", Index::No}, {"yes", Index::Yes}, {"unique", Index::Unique}});
 		if (!index) {
-			_log.warning("Invalid sql.index option for {}.{}: {}", msg->name, f.name, index.error());
+			_log.warning("Invalid sql.index option for {}.{}: {}", msg->name, op.name, index.error());
 		} else if (*index != Index::No) {
-			if (_create_index(table, f.name, *index == Index::Unique))
-				return _log.fail(EINVAL, "Failed to create index {} for table {}", f.name, table);
+			if (_create_index(table, op.name, *index == Index::Unique))
+				return _log.fail(EINVAL, "Failed to create index {} for table {}", op.name, table);
 		}
 	}
 
 	return 0;
 }
 
-int SQLite::_create_select_statement(std::string_view table) {
+tll::result_t<std::string> SQLite::_select_columns(std::string_view table, const tll::scheme::Message * msg, sqlite_bind::plan_t &plan, bool &blob)
+{
+	auto b = _blob_storage(msg);
+	if (!b)
+		return tll::error(fmt::format("Message {}: {}", msg->name, b.error()));
+	blob = *b;
+
+	auto p = sqlite_bind::compile(msg);
+	if (!p)
+		return tll::error(fmt::format("Failed to compile message {}: {}", msg->name, p.error()));
+	plan = std::move(*p);
+	if (std::string error; compress_plan(plan, error))
+		return tll::error(fmt::format("Message {}: {}", msg->name, error));
+
 	std::list<std::string> names;
 	names.push_back("`_tll_seq`");
-	for (auto & f : tll::util::list_wrap(_select_message->fields)) {
-		names.push_back(fmt::format("`{}`", f.name));
+	if (blob)
+		names.push_back("`_tll_data`");
+	else {
+		for (auto & op : plan)
+			names.push_back(fmt::format("`{}`", op.name));
+	}
+	return fmt::format("SELECT {} FROM `{}`", join(names.begin(), names.end()), table);
+}
+
+namespace {
+// Same text for any seq range and limit, so statement can be cached and rebound
+constexpr std::string_view select_range = " WHERE `_tll_seq` >= ? AND `_tll_seq` <= ?";
+constexpr std::string_view select_order = " ORDER BY `_tll_seq`";
+constexpr std::string_view select_limit = " LIMIT ?";
+}
+
+tll::result_t<std::string_view> SQLite::_select_order(std::string_view table, const tll::scheme::Message * msg, bool merge)
+{
+	auto index = tll::getter::getT(msg->options, "sql.index", _seq_index, {{"no", Index::No}, {"yes", Index::Yes}, {"unique", Index::Unique}});
+	if (_seq_key == SeqKey::RowId || (index && *index != Index::No))
+		return select_order;
+
+	// Rowid table without seq index is scanned in insert order
+	auto without_rowid = tll::getter::getT(msg->options, "sql.without-rowid", _without_rowid);
+	if (without_rowid && *without_rowid)
+		return tll::error(fmt::format("WITHOUT ROWID table {} has no seq index, it can not be read in seq order", table));
+	if (merge)
+		return tll::error(fmt::format("Table {} has no seq index, it can not be merged with other tables or shards", table));
+	if (_select_seq || _select_seq_end || _select_limit || _follow || _parallel > 1)
+		return tll::error(fmt::format("Table {} has no seq index, seq range, limit, follow or parallel reads are not supported", table));
+	return std::string_view();
+}
+
+void SQLite::_select_bind(sqlite3_stmt * sql)
+{
+	sqlite3_reset(sql);
+	sqlite3_bind_int64(sql, 1, _select_seq.value_or(std::numeric_limits<long long>::min()));
+	sqlite3_bind_int64(sql, 2, _select_seq_end.value_or(std::numeric_limits<long long>::max()));
+	sqlite3_bind_int64(sql, 3, _select_limit.value_or(-1));
+}
+
+void SQLite::_select_park()
+{
+	if (!_select_statement || !_select_message)
+		return;
+	// Reset releases read transaction held by unfinished statement
+	sqlite3_reset(_select_statement.get());
+	if (auto cached = _select_cache.find(_select_message->msgid); cached)
+		cached->statement = std::move(_select_statement);
+	_select_statement.reset();
+}
+
+SQLite::select_cache_t * SQLite::_select_cached(std::string_view table, const tll::scheme::Message * msg)
+{
+	if (auto cached = _select_cache.find(msg->msgid); cached)
+		return cached;
+	select_cache_t entry;
+	auto columns = _select_columns(table, msg, entry.plan, entry.blob);
+	if (!columns)
+		return _log.fail(nullptr, "{}", columns.error());
+	entry.columns = std::move(*columns);
+	return _select_cache.emplace(msg->msgid, std::move(entry));
+}
+
+void SQLite::_select_finish()
+{
+	_select_active = false;
+	_select_park();
+	for (auto & c : _shard_cursors) {
+		if (c.select)
+			sqlite3_reset(c.select.get());
+	}
+	_shard_heap.clear();
+	_partitions_stop();
+}
+
+int SQLite::_create_select_statement(std::string_view table) {
+	_partitions_stop();
+	_select_table = table;
+
+	auto cached = _select_cached(table, _select_message);
+	if (!cached)
+		return EINVAL;
+	// Copy of plan shares codecs with cache entry
+	_select_plan = cached->plan;
+	_select_blob = cached->blob;
+	auto select = cached->columns;
+
+	auto order = _select_order(table, _select_message, _shard_cursors.size());
+	if (!order)
+		return _log.fail(EINVAL, "{}", order.error());
+
+	if (_parallel > 1) {
+		_partition_select = select + " WHERE `_tll_seq` >= ? AND `_tll_seq` <= ? ORDER BY `_tll_seq`";
+		if (_select_limit)
+			_partition_select += " LIMIT ?";
+		return 0;
 	}
-	std::string select = fmt::format("SELECT {} FROM `{}`", join(names.begin(), names.end()), table);
-	_select_statement.reset(_prepare(select));
-	if (!_select_statement) {
-		return _log.fail(EINVAL, "Failed to prepare select statement for table {}: {}", table, select);
+
+	if (_follow && _select_limit)
+		return _log.fail(EINVAL, "Limit is not supported in follow mode");
+
+	select += std::string(select_range) + std::string(*order) + std::string(select_limit);
+
+	if (_shard_cursors.size()) {
+		for (auto & c : _shard_cursors) {
+			c.select.reset(_prepare(c.db.get(), select));
+			if (!c.select)
+				return _log.fail(EINVAL, "Failed to prepare shard select statement for table {}: {}", table, select);
+			c.message = _select_message;
+			c.plan = _select_plan;
+			c.blob = _select_blob;
+			_select_bind(c.select.get());
+		}
+		return 0;
+	}
+
+	if (cached->statement) {
+		_log.debug("Reuse select statement for table {}", table);
+		_select_statement = std::move(cached->statement);
+	} else {
+		_select_statement.reset(_prepare(select));
+		if (!_select_statement)
+			return _log.fail(EINVAL, "Failed to prepare select statement for table {}: {}", table, select);
 	}
+	_select_bind(_select_statement.get());
 	return 0;
 }
 
-int SQLite::_create_statement(std::string_view table, const tll::scheme::Message *msg)
+int SQLite::_select_start()
+{
+	_select_active = true;
+	if (_parallel > 1) {
+		if (_partitions_start())
+			return EINVAL;
+		_update_dcaps(dcaps::Process | dcaps::Pending);
+		return 0;
+	}
+
+	_follow_wait = false;
+	_follow_eod = false;
+	_select_last.reset();
+	if (_follow) {
+		_data_version.reset(_prepare("PRAGMA data_version"));
+		if (!_data_version)
+			return _log.fail(EINVAL, "Failed to prepare data_version statement");
+		// Get version before query so changes committed while reading are not lost
+		if (_data_version_get(_data_version_last))
+			return EINVAL;
+		if (_follow_timer->state() != TLL_STATE_ACTIVE && _follow_timer->open())
+			return _log.fail(EINVAL, "Failed to open follow timer");
+	}
+	if (_shard_cursors.size()) {
+		_shard_heap.clear();
+		_shard_rows = 0;
+		for (auto i = 0u; i < _shard_cursors.size(); i++) {
+			if (_shard_step(i))
+				return EINVAL;
+		}
+	}
+	_update_dcaps(dcaps::Process | dcaps::Pending);
+	return 0;
+}
+
+int SQLite::_data_version_get(long long &version)
+{
+	sqlite3_reset(_data_version.get());
+	if (sqlite3_step(_data_version.get()) != SQLITE_ROW)
+		return _log.fail(EINVAL, "Failed to get data version: {}", sqlite3_errmsg(_db.get()));
+	version = sqlite3_column_int64(_data_version.get(), 0);
+	// Unfinished statement holds read transaction and WAL can not be restarted by checkpoint
+	sqlite3_reset(_data_version.get());
+	return 0;
+}
+
+int SQLite::_on_follow_timer(const tll::Channel *, const tll_msg_t *msg)
+{
+	if (msg->type != TLL_MESSAGE_DATA || !_follow_wait)
+		return 0;
+
+	long long version = 0;
+	if (_data_version_get(version))
+		return state_fail(EINVAL, "Failed to check for new data");
+	if (version == _data_version_last)
+		return 0;
+
+	_follow_wait = false;
+	_data_version_last = version;
+	sqlite3_reset(_select_statement.get());
+	if (_select_last) {
+		_log.trace("Database changed, continue from seq {}", *_select_last + 1);
+		sqlite3_bind_int64(_select_statement.get(), 1, *_select_last + 1);
+	}
+	_update_dcaps(dcaps::Process | dcaps::Pending);
+	return 0;
+}
+
+int SQLite::_create_statement(std::string_view table, const tll::scheme::Message *msg, sqlite_bind::plan_t &&plan, bool blob)
 {
 	std::list<std::string> names;
 	names.push_back("`_tll_seq`");
-	for (auto & f : tll::util::list_wrap(msg->fields))
-		names.push_back(fmt::format("`{}`", f.name));
+	for (auto & op : plan)
+		names.push_back(fmt::format("`{}`", op.name));
+	if (blob)
+		names.push_back("`_tll_data`");
 
 	std::string_view operation = "INSERT";
 	if (_replace)
 		operation = "REPLACE";
 	auto insert = fmt::format("{} INTO `{}`({}) VALUES ", operation, table, join(names.begin(), names.end()));
+
+	std::string upsert;
+	if (_upsert) {
+		std::list<std::string> keys, update, changed;
+		for (auto & op : plan) {
+			if (op.field->type == op.field->Union && op.kind != sqlite_bind::op_t::Blob)
+				continue;
+			if (primary_key(op.field))
+				keys.push_back(fmt::format("`{}`", op.name));
+		}
+		if (keys.empty())
+			keys.push_back("`_tll_seq`");
+		for (auto & n : names) {
+			if (std::find(keys.begin(), keys.end(), n) != keys.end())
+				continue;
+			update.push_back(fmt::format("{0} = excluded.{0}", n));
+			// Seq alone does not make row different, it is updated only with other columns
+			if (n != "`_tll_seq`")
+				changed.push_back(fmt::format("{0} IS NOT excluded.{0}", n));
+		}
+		upsert = fmt::format(" ON CONFLICT({}) DO ", join(keys.begin(), keys.end()));
+		if (update.empty())
+			upsert += "NOTHING";
+		else {
+			upsert += fmt::format("UPDATE SET {}", join(update.begin(), update.end()));
+			if (changed.size())
+				upsert += fmt::format(" WHERE {}", join(" OR ", changed.begin(), changed.end()));
+		}
+	}
+
 	for (auto & i : names)
 		i = "?";
-	insert += fmt::format("({})", join(names.begin(), names.end()));
+	auto values = fmt::format("({})", join(names.begin(), names.end()));
+
+	message_t m = { msg, std::string(table), nullptr, std::move(plan), blob };
+	m.insert_sql = insert + values + upsert;
+
+	const size_t limit = sqlite3_limit(_db.get(), SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+	m.rows = std::max<size_t>(1, std::min(_rows_per_statement, limit / names.size()));
+	if (m.rows < _rows_per_statement)
+		_log.info("Limit rows per statement for {} to {}: {} columns, {} variables", msg->name, m.rows, names.size(), limit);
+	if (m.rows > 1) {
+		std::vector<std::string_view> rows(m.rows, values);
+		m.insert_bulk_sql = insert + join(rows.begin(), rows.end()) + upsert;
+		m.staged.reserve(m.rows);
+	}
 
-	query_ptr_t sql;
+	// Conflict target needs primary key or unique index, fail on open and not on first post
+	if (_upsert && _prepare_statement(m))
+		return _log.fail(EINVAL, "Upsert for table {} needs primary key field or unique seq index", table);
 
-	sql.reset(_prepare(insert));
-	if (!sql)
-		return _log.fail(EINVAL, "Failed to prepare update statement for table {}: {}", table, insert);
+	_messages.emplace(msg->msgid, std::move(m));
 
-	_messages.emplace(msg->msgid, std::make_pair(msg, std::move(sql)));
+	return 0;
+}
 
+int SQLite::_prepare_statement(message_t &m)
+{
+	m.insert.reset(_prepare(m.insert_sql));
+	if (!m.insert)
+		return _log.fail(EINVAL, "Failed to prepare insert statement for table {}: {}", m.table, m.insert_sql);
+	if (m.rows > 1) {
+		m.insert_bulk.reset(_prepare(m.insert_bulk_sql));
+		if (!m.insert_bulk)
+			return _log.fail(EINVAL, "Failed to prepare bulk insert statement for table {}", m.table);
+	}
 	return 0;
 }
 
 int SQLite::_create_index(const std::string_view &name, std::string_view key, bool unique)
 {
 	_log.debug("Create index for {}: key {}", name, key);
-	query_ptr_t sql;
 
 	std::string_view ustr = unique ? "UNIQUE " : "";
 	auto str = fmt::format("CREATE {} INDEX `_tll_{}_{}` on `{}`(`{}`)", ustr, name, key, name, key);
-	sql.reset(_prepare(str));
-	if (!sql)
-		return _log.fail(EINVAL, "Failed to prepare index statement: {}", str);
-
-	if (sqlite3_step(sql.get()) != SQLITE_DONE)
+	if (_index_create(str, unique && (_replace || _upsert)))
 		return _log.fail(EINVAL, "Failed to create index for '{}': {}", name, key);
 	return 0;
 }
 
 int SQLite::_close()
 {
+	if (!_async && _db && _flush())
+		_log.error("Failed to commit pending data");
+	int async_error = 0;
+	if (_async_thread.joinable()) {
+		_log.debug("Stop async writer thread");
+		_async_stop = true;
+		{
+			std::unique_lock<std::mutex> lock(_async_lock);
+			_async_cond.notify_one();
+		}
+		_async_thread.join();
+		async_error = _async_error;
+	}
+	if (_follow_timer)
+		_follow_timer->close();
+	_follow_wait = false;
+	_data_version.reset();
+	_select_active = false;
+	_select_statement.reset();
+	_select_cache.clear();
+	for (auto & m : _messages) {
+		if (m.inserted)
+			_log.info("Inserted {} rows of {} into table {}", m.inserted, m.message->name, m.table);
+	}
 	_messages.clear();
-	return SQLBase<SQLite>::_close();
+	// Shard writers are async, close reports messages lost by writer thread
+	int shard_error = 0;
+	for (auto & c : _shard_writers) {
+		if (auto r = c->close(); r) {
+			_log.error("Failed to close shard writer {}: {}", c->name(), strerror(r));
+			shard_error = r;
+		}
+	}
+	_shard_routes.clear();
+	_shard_heap.clear();
+	_shard_cursors.clear();
+	_partitions_stop();
+	auto r = SQLBase<SQLite>::_close();
+	if (async_error)
+		return _log.fail(EINVAL, "Async writer failed: {}, some messages are lost", strerror(async_error));
+	if (shard_error)
+		return _log.fail(EINVAL, "Some shard writers failed, messages may be lost");
+	return r;
 }
 
 int SQLite::_post(const tll_msg_t *msg, int flags)
@@ -416,81 +996,674 @@ int SQLite::_post(const tll_msg_t *msg, int flags)
 	if (msg->type != TLL_MESSAGE_DATA && msg->type != TLL_MESSAGE_CONTROL)
 		return 0;
 
+	if (_shard_routes.size())
+		return _post_shard(msg);
+
+	if (_async)
+		return _post_async(msg);
+
 	if (msg->type == TLL_MESSAGE_CONTROL) {
 		if (msg->msgid == sqlite_scheme::TableName::id) {
-			_select_message = _messages.at(((const sqlite_scheme::TableName*) msg->data)->msgid).first;
-			if (_create_select_statement(std::string_view(_select_message->name))) {
+			_partitions_stop();
+			auto data = (const sqlite_scheme::TableName *) msg->data;
+			auto m = _message_lookup(data->msgid);
+			if (!m)
+				return _log.fail(ENOENT, "Message {} not found", data->msgid);
+			// Switch in the middle of read, current statement is kept for later reuse
+			_select_park();
+			_select_active = false;
+			_shard_heap.clear();
+			// Shard reader prepares new statements on its shard connections,
+			// multi-table cursors share main connection and are replaced by single table select
+			if (!_shards)
+				_shard_cursors.clear();
+			_select_message = m;
+			_select_seq.reset();
+			_select_seq_end.reset();
+			_select_limit.reset();
+			if (msg->size >= sizeof(sqlite_scheme::TableName)) {
+				if (data->seq)
+					_select_seq = data->seq;
+				if (data->seq_end)
+					_select_seq_end = data->seq_end;
+				if (data->limit)
+					_select_limit = data->limit;
+			}
+			if (_create_select_statement(message_table(*_select_message))) {
 				return EINVAL;
 			}
-			_update_dcaps(dcaps::Process | dcaps::Pending);
-			return 0;
+			return _select_start();
 		}
+		if (msg->msgid == sqlite_scheme::LastSeqQuery::id)
+			return _last_seq(msg);
+		if (auto r = _post_control(msg); r != ENOENT)
+			return r;
 		return EINVAL;
 	}
 
+	return _post_data(msg);
+}
+
+int SQLite::_last_seq(const tll_msg_t *msg)
+{
+	if (msg->size < sizeof(sqlite_scheme::LastSeqQuery))
+		return _log.fail(EMSGSIZE, "LastSeqQuery message size {} is too small", msg->size);
+	auto msgid = ((const sqlite_scheme::LastSeqQuery *) msg->data)->msgid;
+	auto m = _messages.find(msgid);
+	if (!m)
+		return _log.fail(ENOENT, "Message {} not found", msgid);
+
+	query_ptr_t sql;
+	sql.reset(_prepare(fmt::format("SELECT max(`_tll_seq`) FROM `{}`", m->table)));
+	if (!sql)
+		return _log.fail(EINVAL, "Failed to prepare last seq query for table {}", m->table);
+	if (sqlite3_step(sql.get()) != SQLITE_ROW)
+		return _log.fail(EINVAL, "Failed to query last seq for table {}: {}", m->table, sqlite3_errmsg(_db.get()));
+
+	sqlite_scheme::LastSeq data = { msgid, -1 };
+	if (sqlite3_column_type(sql.get(), 0) != SQLITE_NULL)
+		data.seq = sqlite3_column_int64(sql.get(), 0);
+	_log.debug("Last seq for table {}: {}", m->table, data.seq);
+
+	tll_msg_t reply = { .type = TLL_MESSAGE_CONTROL, .msgid = sqlite_scheme::LastSeq::id };
+	reply.data = &data;
+	reply.size = sizeof(data);
+	_callback(&reply);
+	return 0;
+}
+
+int SQLite::_bind(const message_t &m, sqlite3_stmt * sql, int idx, const tll_msg_t *msg)
+{
+	sqlite3_bind_int64(sql, idx, (sqlite3_int64) msg->seq);
+	if (auto r = sqlite_bind::bind(sql, idx + 1, m.plan, msg); r)
+		return r;
+	if (m.blob)
+		return sqlite3_bind_blob(sql, idx + 1 + m.plan.size(), msg->data, msg->size, SQLITE_STATIC);
+	return SQLITE_OK;
+}
+
+int SQLite::_post_data(const tll_msg_t *msg)
+{
 	if (msg->msgid == 0)
 		return _log.fail(EINVAL, "Unable to insert message without msgid");
-	auto it = _messages.find(msg->msgid);
-	if (it == _messages.end())
+	auto mp = _messages.find(msg->msgid);
+	if (!mp)
 		return _log.fail(ENOENT, "Message {} not found", msg->msgid);
-	auto & [message, insert] = it->second;
+	auto & m = *mp;
+	if (msg->size < m.message->size)
+		return _log.fail(EMSGSIZE, "Message {} size {} is less than minimal {}", m.message->name, msg->size, m.message->size);
 
-	if (!_bulk_counter) {
-		sqlite3_exec(_db.get(), "BEGIN", 0, 0, 0);
-	}
+	if (!m.insert && _prepare_statement(m))
+		return EINVAL;
 
-	sqlite3_reset(insert.get());
+	if (auto r = _begin(); r)
+		return r;
 
-	auto view = tll::make_view(*msg);
+	if (m.rows > 1)
+		return _post_staged(m, msg);
 
-	int idx = 1;
-	sqlite3_bind_int64(insert.get(), idx++, (sqlite3_int64) msg->seq);
-	for (auto & f : tll::util::list_wrap(message->fields)) {
-		if (sql_bind(insert.get(), idx++, &f, view.view(f.offset)))
-			return _log.fail(EINVAL, "Failed to bind field {}", f.name);
-	}
-	auto r = sqlite3_step(insert.get());
+	auto sql = m.insert.get();
+	sqlite3_reset(sql);
+
+	if (auto r = _bind(m, sql, 1, msg); r)
+		return _log.fail(EINVAL, "Failed to bind message {}: {}", m.message->name, sqlite3_errstr(r));
+	auto r = _step(sql, 1, msg->size);
 	if (r != SQLITE_DONE)
 		return _log.fail(EINVAL, "Failed to insert data: {}", sqlite3_errmsg(_db.get()));
-	if (++_bulk_counter >= _bulk_size) {
-		_commit();
+	m.inserted++;
+	return _bulk_update(msg->size);
+}
+
+int SQLite::_post_staged(message_t &m, const tll_msg_t *msg)
+{
+	auto offset = m.staged_data.size();
+	m.staged_data.resize(offset + msg->size);
+	memcpy(m.staged_data.data() + offset, msg->data, msg->size);
+	m.staged.push_back(staged_t { msg->seq, offset, msg->size });
+
+	if (m.staged.size() == m.rows) {
+		auto sql = m.insert_bulk.get();
+		sqlite3_reset(sql);
+
+		const int columns = m.columns();
+		int idx = 1;
+		for (auto & s : m.staged) {
+			tll_msg_t row = { .type = TLL_MESSAGE_DATA, .msgid = m.message->msgid, .seq = s.seq };
+			row.data = m.staged_data.data() + s.offset;
+			row.size = s.size;
+			if (auto r = _bind(m, sql, idx, &row); r)
+				return _log.fail(EINVAL, "Failed to bind message {}: {}", m.message->name, sqlite3_errstr(r));
+			idx += columns;
+		}
+
+		auto r = _step(sql, m.rows, m.staged_data.size());
+		m.staged.clear();
+		m.staged_data.clear();
+		if (r != SQLITE_DONE)
+			return _log.fail(EINVAL, "Failed to insert {} rows: {}", m.rows, sqlite3_errmsg(_db.get()));
+		m.inserted += m.rows;
+	}
+	return _bulk_update(msg->size);
+}
+
+int SQLite::_on_commit()
+{
+	for (auto & m : _messages) {
+		if (!m.staged.size())
+			continue;
+		_log.debug("Insert {} staged rows of {}", m.staged.size(), m.message->name);
+		auto sql = m.insert.get();
+		for (auto & s : m.staged) {
+			tll_msg_t row = { .type = TLL_MESSAGE_DATA, .msgid = m.message->msgid, .seq = s.seq };
+			row.data = m.staged_data.data() + s.offset;
+			row.size = s.size;
+			sqlite3_reset(sql);
+			if (auto r = _bind(m, sql, 1, &row); r)
+				return _log.fail(EINVAL, "Failed to bind message {}: {}", m.message->name, sqlite3_errstr(r));
+			if (_step(sql, 1, s.size) != SQLITE_DONE) {
+				m.staged.clear();
+				m.staged_data.clear();
+				return _log.fail(EINVAL, "Failed to insert data: {}", sqlite3_errmsg(_db.get()));
+			}
+			m.inserted++;
+		}
+		m.staged.clear();
+		m.staged_data.clear();
 	}
 	return 0;
 }
 
-int SQLite::_process(long timeout, int flags) {
-	int result = sqlite3_step(_select_statement.get()); // 100 AS SQLITE_ROW, 101 AS SQLITE_DONE
+int SQLite::_post_async(const tll_msg_t *msg)
+{
+	if (_async_error)
+		return state_fail(EINVAL, "Async writer failed: {}", strerror(_async_error));
+
+	if (msg->type == TLL_MESSAGE_CONTROL && msg->msgid != sqlite_scheme::Commit::id && msg->msgid != sqlite_scheme::BuildIndex::id)
+		return _log.fail(EINVAL, "Control message {} is not supported in async mode", msg->msgid);
+
+	if (sizeof(async_header_t) + msg->size > _async_ring.max_record())
+		return _log.fail(EMSGSIZE, "Message size {} is too large for async ring", msg->size);
+
+	auto ptr = static_cast<char *>(_async_ring.write_begin(sizeof(async_header_t) + msg->size));
+	while (!ptr) {
+		if (_async_full == AsyncFull::EAgain)
+			return EAGAIN;
+		if (_async_error)
+			return state_fail(EINVAL, "Async writer failed: {}", strerror(_async_error));
+		std::this_thread::yield();
+		ptr = static_cast<char *>(_async_ring.write_begin(sizeof(async_header_t) + msg->size));
+	}
 
-	if (result == SQLITE_ROW) {
+	auto header = reinterpret_cast<async_header_t *>(ptr);
+	header->type = msg->type;
+	header->msgid = msg->msgid;
+	header->seq = msg->seq;
+	memcpy(ptr + sizeof(async_header_t), msg->data, msg->size);
+	_async_ring.write_end();
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (_async_sleep) {
+		std::unique_lock<std::mutex> lock(_async_lock);
+		_async_cond.notify_one();
+	}
+	return 0;
+}
+
+void SQLite::_async_run()
+{
+	_log.info("Async writer thread started");
+	for (;;) {
+		tll::duration timeout = std::chrono::milliseconds(100);
+		if (_bulk_interval.count() && _bulk_counter && !_async_error) {
+			auto now = tll::time::now();
+			if (now >= _bulk_last + _bulk_interval) {
+				if (_flush()) {
+					_log.error("Async writer failed to commit transaction on timeout");
+					_async_error = EINVAL;
+				}
+			} else
+				timeout = std::min<tll::duration>(timeout, _bulk_last + _bulk_interval - now);
+		}
+
+		size_t size;
+		auto ptr = static_cast<const char *>(_async_ring.read(&size));
+		if (!ptr) {
+			if (_async_stop)
+				break;
+			std::unique_lock<std::mutex> lock(_async_lock);
+			_async_sleep = true;
+			_async_cond.wait_for(lock, timeout, [this]() { return _async_stop || !_async_ring.empty(); });
+			_async_sleep = false;
+			continue;
+		}
+
+		if (_async_error) { // Drop data after failure
+			_async_ring.shift();
+			continue;
+		}
+
+		auto header = reinterpret_cast<const async_header_t *>(ptr);
 		tll_msg_t msg = {
-			.type = TLL_MESSAGE_DATA,
-			.msgid = _select_message->msgid,
-			.seq = sqlite3_column_int64(_select_statement.get(), 0)
+			.type = header->type,
+			.msgid = header->msgid,
+			.seq = header->seq,
 		};
-		std::vector<unsigned char> buf;
-		buf.resize(_select_message->size);
-		auto view = tll::make_view(buf);
-		int idx = 1;
-		for (auto & f : tll::util::list_wrap(_select_message->fields)) {
-			if (sql_column_(_select_statement.get(), idx++, &f, view.view(f.offset))) {
-				return EINVAL;
-			}
+		msg.data = ptr + sizeof(async_header_t);
+		msg.size = size - sizeof(async_header_t);
+
+		int r = 0;
+		if (msg.type == TLL_MESSAGE_CONTROL)
+			r = _post_control(&msg);
+		else
+			r = _post_data(&msg);
+		if (r) {
+			_log.error("Async writer failed to post message {} (seq {}): {}", msg.msgid, msg.seq, strerror(r));
+			_async_error = r;
 		}
-		msg.size = buf.size();
-		msg.data = buf.data();
+		_async_ring.shift();
+	}
+
+	if (!_async_error && _flush())
+		_async_error = EINVAL;
+	_log.info("Async writer thread finished");
+}
+
+int SQLite::_process(long timeout, int flags)
+{
+	auto deadline = _batch_time.count() ? tll::time::now() + _batch_time : tll::time::time_point {};
+	for (auto i = 0u; i < _batch; i++) {
+		if (!_select_active || _follow_wait)
+			return EAGAIN;
+		if (auto r = _process_row(); r)
+			return r == EAGAIN ? 0 : r;
+		if (deadline.time_since_epoch().count() && tll::time::now() > deadline)
+			break;
+	}
+	return 0;
+}
+
+int SQLite::_emit_row(sqlite3_stmt * sql, const tll::scheme::Message * message, const sqlite_bind::plan_t &plan, bool blob)
+{
+	tll_msg_t msg = {
+		.type = TLL_MESSAGE_DATA,
+		.msgid = message->msgid,
+		.seq = sqlite3_column_int64(sql, 0)
+	};
+	_select_last = msg.seq;
+	if (blob) {
+		msg.data = sqlite3_column_blob(sql, 1);
+		msg.size = sqlite3_column_bytes(sql, 1);
+		if (msg.size < message->size)
+			return _log.fail(EMSGSIZE, "Stored message {} size {} is less than minimal {} (seq {})", message->name, msg.size, message->size, msg.seq);
 		_callback_data(&msg);
 		return 0;
+	}
+	_select_buf.clear();
+	_select_buf.resize(message->size);
+	if (sqlite_bind::column(sql, 1, plan, _select_buf))
+		return _log.fail(EINVAL, "Failed to read message {} (seq {})", message->name, msg.seq);
+	msg.size = _select_buf.size();
+	msg.data = _select_buf.data();
+	_callback_data(&msg);
+	return 0;
+}
+
+int SQLite::_process_row()
+{
+	if (_shard_cursors.size())
+		return _process_shard_row();
+	if (_parallel_active)
+		return _process_partition_row();
+
+	auto sql = _select_statement.get();
+	int result = sqlite3_step(sql);
+
+	if (result == SQLITE_ROW) {
+		return _emit_row(sql);
 	} else if (result == SQLITE_DONE) {
 		_update_dcaps(0, dcaps::Process | dcaps::Pending);
+		if (_follow && (!_select_seq_end || !_select_last || *_select_last < *_select_seq_end)) {
+			_follow_wait = true;
+			if (!_follow_eod) {
+				_follow_eod = true;
+				tll_msg_t msg = { .type = TLL_MESSAGE_CONTROL, .msgid = sqlite_scheme::EndOfData::id };
+				_callback(&msg);
+			}
+			return EAGAIN;
+		}
 		tll_msg_t msg = { .type = TLL_MESSAGE_CONTROL, .msgid = sqlite_scheme::EndOfData::id };
 		_callback(&msg);
-		SQLite::_close();
+		_select_finish();
+		return EAGAIN;
+	}
+	return _log.fail(EINVAL, "Failed to fetch data from {}: {}", _select_message->name, sqlite3_errmsg(_db.get()));
+}
+
+int SQLite::_shards_open(std::string_view table)
+{
+	if (!table.size()) {
+		for (auto & m : tll::util::list_wrap(_scheme->messages)) {
+			if (m.msgid == 0)
+				continue;
+			shard_route_t route = { &m };
+			for (auto & f : tll::util::list_wrap(m.fields)) {
+				auto key = tll::getter::getT(f.options, "sql.shard-key", false);
+				if (!key)
+					return _log.fail(EINVAL, "Invalid sql.shard-key option for {}.{}: {}", m.name, f.name, key.error());
+				if (!*key)
+					continue;
+				auto kind = sqlite_bind::kind(&f);
+				if (!kind)
+					return _log.fail(EINVAL, "Shard key {}.{}: {}", m.name, f.name, kind.error());
+				route.key = sqlite_bind::op_t { *kind, (unsigned) f.offset, (unsigned) f.size, &f, f.name };
+				break;
+			}
+			_shard_routes.emplace(m.msgid, std::move(route));
+		}
+
+		for (auto & c : _shard_writers) {
+			if (c->open())
+				return _log.fail(EINVAL, "Failed to open shard writer {}", c->name());
+		}
 		return 0;
 	}
-	_log.debug("nouret: {}\t", sqlite3_column_int(_select_statement.get(), 0));
+
+	_select_message = _table_lookup(table);
+	if (!_select_message)
+		return _log.fail(ENOENT, "Table '{}' not found in scheme", table);
+
+	for (auto i = 0u; i < _shards; i++) {
+		auto path = fmt::format("{}.{}", _path, i);
+		sqlite3 * db = nullptr;
+		auto r = sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr);
+		if (r) {
+			sqlite3_close(db);
+			return _log.fail(EINVAL, "Failed to open shard '{}': {}", path, sqlite3_errstr(r));
+		}
+		_shard_cursors.push_back(shard_cursor_t { std::shared_ptr<sqlite3>(db, sqlite3_close) });
+	}
+
+	if (_create_select_statement(table))
+		return EINVAL;
+	return _select_start();
+}
+
+int SQLite::_merge_open(std::string_view tables)
+{
+	if (_parallel > 1 || _follow)
+		return _log.fail(EINVAL, "Multi-table read is not supported in parallel or follow mode");
+	_select_table = tables;
+
+	for (auto table : tll::split<','>(tables)) {
+		if (table.empty())
+			continue;
+		auto msg = _table_lookup(table);
+		if (!msg)
+			return _log.fail(ENOENT, "Table '{}' not found in scheme", table);
+
+		shard_cursor_t cursor = { _db };
+		cursor.message = msg;
+		auto columns = _select_columns(table, msg, cursor.plan, cursor.blob);
+		if (!columns)
+			return _log.fail(EINVAL, "{}", columns.error());
+		auto order = _select_order(table, msg, true);
+		if (!order)
+			return _log.fail(EINVAL, "{}", order.error());
+		auto select = *columns + std::string(select_range) + std::string(*order) + std::string(select_limit);
+		cursor.select.reset(_prepare(select));
+		if (!cursor.select)
+			return _log.fail(EINVAL, "Failed to prepare select statement for table {}: {}", table, select);
+		_select_bind(cursor.select.get());
+		_shard_cursors.push_back(std::move(cursor));
+	}
+	if (_shard_cursors.empty())
+		return _log.fail(EINVAL, "Empty table list '{}'", tables);
+	_select_message = _shard_cursors.front().message;
+	return _select_start();
+}
+
+int SQLite::_shard_step(unsigned idx)
+{
+	auto & cursor = _shard_cursors[idx];
+	auto r = sqlite3_step(cursor.select.get());
+	if (r == SQLITE_DONE)
+		return 0;
+	if (r != SQLITE_ROW)
+		return _log.fail(EINVAL, "Failed to fetch data from shard {}: {}", idx, sqlite3_errmsg(cursor.db.get()));
+	cursor.seq = sqlite3_column_int64(cursor.select.get(), 0);
+	_shard_heap.push_back(idx);
+	std::push_heap(_shard_heap.begin(), _shard_heap.end(), [this](unsigned l, unsigned r) { return _shard_cursors[l].seq > _shard_cursors[r].seq; });
 	return 0;
 }
 
+int SQLite::_process_shard_row()
+{
+	if (_shard_heap.empty() || (_select_limit && _shard_rows >= *_select_limit)) {
+		_update_dcaps(0, dcaps::Process | dcaps::Pending);
+		tll_msg_t msg = { .type = TLL_MESSAGE_CONTROL, .msgid = sqlite_scheme::EndOfData::id };
+		_callback(&msg);
+		_select_finish();
+		return EAGAIN;
+	}
+
+	std::pop_heap(_shard_heap.begin(), _shard_heap.end(), [this](unsigned l, unsigned r) { return _shard_cursors[l].seq > _shard_cursors[r].seq; });
+	auto idx = _shard_heap.back();
+	_shard_heap.pop_back();
+
+	_shard_rows++;
+	auto & cursor = _shard_cursors[idx];
+	if (auto r = _emit_row(cursor.select.get(), cursor.message, cursor.plan, cursor.blob); r)
+		return r;
+	if (_shard_cursors.empty()) // Closed from callback
+		return EAGAIN;
+	return _shard_step(idx);
+}
+
+int SQLite::_post_shard(const tll_msg_t *msg)
+{
+	if (msg->type == TLL_MESSAGE_CONTROL) {
+		if (msg->msgid != sqlite_scheme::Commit::id && msg->msgid != sqlite_scheme::BuildIndex::id)
+			return _log.fail(EINVAL, "Control message {} is not supported in sharded mode", msg->msgid);
+		for (auto & c : _shard_writers) {
+			if (auto r = c->post(msg); r)
+				return r;
+		}
+		return 0;
+	}
+
+	auto route = _shard_routes.find(msg->msgid);
+	if (!route)
+		return _log.fail(ENOENT, "Message {} not found", msg->msgid);
+	if (msg->size < route->message->size)
+		return _log.fail(EMSGSIZE, "Message {} size {} is less than minimal {}", route->message->name, msg->size, route->message->size);
+	size_t hash = route->key ? shard_hash(*route->key, msg) : (unsigned) msg->msgid;
+	return _shard_writers[hash % _shards]->post(msg);
+}
+
+int SQLite::_partitions_start()
+{
+	_partitions_stop();
+	_parallel_rows = 0;
+
+	std::list<std::string> where;
+	if (_select_seq)
+		where.push_back("`_tll_seq` >= ?");
+	if (_select_seq_end)
+		where.push_back("`_tll_seq` <= ?");
+	auto str = fmt::format("SELECT min(`_tll_seq`), max(`_tll_seq`) FROM `{}`", _select_table);
+	if (where.size())
+		str += fmt::format(" WHERE {}", join(" AND ", where.begin(), where.end()));
+
+	query_ptr_t sql;
+	sql.reset(_prepare(str));
+	if (!sql)
+		return _log.fail(EINVAL, "Failed to prepare seq range query for table {}", _select_table);
+	int idx = 1;
+	for (auto & v : { _select_seq, _select_seq_end }) {
+		if (v)
+			sqlite3_bind_int64(sql.get(), idx++, *v);
+	}
+	if (sqlite3_step(sql.get()) != SQLITE_ROW)
+		return _log.fail(EINVAL, "Failed to get seq range of table {}: {}", _select_table, sqlite3_errmsg(_db.get()));
+
+	_parallel_active = true;
+	_parallel_stop = false;
+	if (sqlite3_column_type(sql.get(), 0) == SQLITE_NULL) {
+		_log.debug("No data in table {} for parallel read", _select_table);
+		return 0;
+	}
+	const long long first = sqlite3_column_int64(sql.get(), 0);
+	const long long last = sqlite3_column_int64(sql.get(), 1);
+
+	// Unsigned arithmetic, seq span may not fit into signed type
+	const unsigned long long span = (unsigned long long) last - (unsigned long long) first;
+	const unsigned long long step = span / _parallel + 1;
+	for (unsigned long long off = 0; off <= span; off += step) {
+		auto p = std::make_unique<partition_t>();
+		p->begin = (long long) ((unsigned long long) first + off);
+		p->end = (long long) ((unsigned long long) first + std::min(span, off + step - 1));
+		p->ring.resize(_async_size);
+		_partitions.push_back(std::move(p));
+		if (off + step < off) // Overflow on last partition
+			break;
+	}
+	_partition_left = _partitions.size();
+
+	_log.info("Read table {} in {} partitions, seq range [{}, {}]", _select_table, _partitions.size(), first, last);
+	for (auto & p : _partitions)
+		p->thread = std::thread(&SQLite::_partition_run, this, p.get());
+	return 0;
+}
+
+void SQLite::_partitions_stop()
+{
+	_parallel_active = false;
+	_partition_current = 0;
+	_partition_left = 0;
+	if (_partitions.empty())
+		return;
+	_parallel_stop = true;
+	for (auto & p : _partitions) {
+		if (p->thread.joinable())
+			p->thread.join();
+	}
+	_partitions.clear();
+}
+
+void SQLite::_partition_run(partition_t * p)
+{
+	auto fail = [this, p](auto msg) {
+		_log.error("Partition [{}, {}] failed: {}", p->begin, p->end, msg);
+		p->error = true;
+		p->done.store(true, std::memory_order_release);
+	};
+
+	sqlite3 * db = nullptr;
+	if (auto r = sqlite3_open_v2(_path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr); r) {
+		sqlite3_close(db);
+		return fail(fmt::format("failed to open database: {}", sqlite3_errstr(r)));
+	}
+	std::unique_ptr<sqlite3, decltype(&sqlite3_close)> dbptr(db, sqlite3_close);
+
+	query_ptr_t sql;
+	sql.reset(_prepare(db, _partition_select));
+	if (!sql)
+		return fail("failed to prepare select statement");
+	sqlite3_bind_int64(sql.get(), 1, p->begin);
+	sqlite3_bind_int64(sql.get(), 2, p->end);
+	if (_select_limit)
+		sqlite3_bind_int64(sql.get(), 3, *_select_limit);
+
+	std::vector<unsigned char> buf;
+	while (!_parallel_stop) {
+		auto r = sqlite3_step(sql.get());
+		if (r == SQLITE_DONE)
+			break;
+		if (r != SQLITE_ROW)
+			return fail(fmt::format("failed to fetch data: {}", sqlite3_errmsg(db)));
+
+		const int64_t seq = sqlite3_column_int64(sql.get(), 0);
+		const void * data = nullptr;
+		size_t size = 0;
+		if (_select_blob) {
+			data = sqlite3_column_blob(sql.get(), 1);
+			size = sqlite3_column_bytes(sql.get(), 1);
+		} else {
+			buf.clear();
+			buf.resize(_select_message->size);
+			if (sqlite_bind::column(sql.get(), 1, _select_plan, buf))
+				return fail(fmt::format("failed to read message {} (seq {})", _select_message->name, seq));
+			data = buf.data();
+			size = buf.size();
+		}
+
+		if (sizeof(seq) + size > p->ring.max_record())
+			return fail(fmt::format("message size {} is too large for ring (seq {})", size, seq));
+		auto ptr = static_cast<char *>(p->ring.write_begin(sizeof(seq) + size));
+		while (!ptr) {
+			if (_parallel_stop)
+				break;
+			std::this_thread::yield();
+			ptr = static_cast<char *>(p->ring.write_begin(sizeof(seq) + size));
+		}
+		if (!ptr)
+			break;
+		memcpy(ptr, &seq, sizeof(seq));
+		if (size)
+			memcpy(ptr + sizeof(seq), data, size);
+		p->ring.write_end();
+	}
+	p->done.store(true, std::memory_order_release);
+}
+
+int SQLite::_process_partition_row()
+{
+	if (!_select_limit || _parallel_rows < *_select_limit) {
+		for (size_t n = 0; n < _partitions.size(); n++, _partition_current = (_partition_current + 1) % _partitions.size()) {
+			auto & p = *_partitions[_partition_current];
+			if (p.finished)
+				continue;
+			// Check done flag before reading ring so records written before it are not missed
+			const bool done = p.done.load(std::memory_order_acquire);
+			if (p.error)
+				return _log.fail(EINVAL, "Parallel reader failed on partition [{}, {}]", p.begin, p.end);
+			size_t size = 0;
+			if (auto ptr = static_cast<const char *>(p.ring.read(&size)); ptr) {
+				tll_msg_t msg = { .type = TLL_MESSAGE_DATA, .msgid = _select_message->msgid };
+				memcpy(&msg.seq, ptr, sizeof(int64_t));
+				msg.data = ptr + sizeof(int64_t);
+				msg.size = size - sizeof(int64_t);
+				if (_select_blob && msg.size < _select_message->size)
+					return _log.fail(EMSGSIZE, "Stored message {} size {} is less than minimal {} (seq {})", _select_message->name, msg.size, _select_message->size, msg.seq);
+				_select_last = msg.seq;
+				_parallel_rows++;
+				_callback_data(&msg);
+				if (!_parallel_active) // Closed from callback
+					return EAGAIN;
+				p.ring.shift();
+				if (!_ordered)
+					_partition_current = (_partition_current + 1) % _partitions.size();
+				return 0;
+			}
+			if (!done) {
+				if (_ordered)
+					return EAGAIN;
+				continue;
+			}
+			p.finished = true;
+			_partition_left--;
+		}
+		if (_partition_left)
+			return EAGAIN;
+	}
+
+	_update_dcaps(0, dcaps::Process | dcaps::Pending);
+	tll_msg_t msg = { .type = TLL_MESSAGE_CONTROL, .msgid = sqlite_scheme::EndOfData::id };
+	_callback(&msg);
+	_select_finish();
+	return EAGAIN;
+}
+
 TLL_DEFINE_IMPL(SQLite);
 
 TLL_DEFINE_MODULE(SQLite);
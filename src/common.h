@@ -3,10 +3,20 @@
 
 #include <sqlite3.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <tll/channel/base.h>
+#include <tll/stat.h>
+#include <tll/util/size.h>
+#include <tll/util/time.h>
+
+#include "sqlite-scheme.h"
 
 // clang-format off
 struct sqlite3_delete { void operator ()(sqlite3 *ptr) const { sqlite3_close(ptr); } };
@@ -27,36 +37,337 @@ class SQLBase : public tll::channel::Base<T>
 	enum class Index { No, Yes, Unique } _seq_index = Index::Unique;
 	enum class Journal { Default, Wal } _journal = Journal::Wal;
 
+	enum class Profile { Default, FastIngest };
+	enum class Synchronous { Default, Off, Normal, Full, Extra };
+	enum class TempStore { Default, File, Memory };
+	enum class LockingMode { Default, Normal, Exclusive };
+
+	size_t _page_size = 0;
+	std::vector<std::string> _pragmas; ///< Connection parameters applied on open
+
+	enum class Checkpoint { Auto, Passive, Full, Restart, Truncate } _checkpoint = Checkpoint::Auto;
+	tll::duration _checkpoint_interval = {};
+	std::thread _checkpoint_thread;
+	std::mutex _checkpoint_lock;
+	std::condition_variable _checkpoint_cond;
+	bool _checkpoint_stop = false;
+
 	size_t _bulk_size = 0;
 	size_t _bulk_counter = 0;
+	size_t _bulk_bytes = 0;
+	size_t _bulk_bytes_counter = 0;
+	tll::duration _bulk_interval = {};
+	tll::time::time_point _bulk_last = {}; ///< Time of last commit, bulk interval is counted from it
+	std::unique_ptr<tll::Channel> _bulk_timer;
+	bool _bulk_thread = false; ///< Commits are done by writer thread that checks bulk interval itself, timer is not used
+
+	bool _bulk_load = false; ///< Postpone index creation for new tables
+	std::vector<std::string> _index_deferred;
+
+	bool _pool = false; ///< Child channel with own read-only connection instead of shared master one
+
+	/// Reaction on locked database: fail or reject messages with EAGAIN and retry on timer
+	enum class BusyPolicy { Fail, EAgain } _busy_policy = BusyPolicy::Fail;
+	tll::duration _busy_timeout = {};
+	std::unique_ptr<tll::Channel> _busy_timer;
+	bool _busy = false; ///< Database is locked, posts are rejected until retry
+	bool _busy_commit = false; ///< COMMIT failed, transaction is kept open and commit is retried
+	unsigned _busy_ticks = 0;
+	unsigned _busy_delay = 0; ///< Backoff in timer ticks, doubled on each failure in a row
+	static constexpr unsigned busy_delay_max = 128;
 
 	static constexpr std::string_view sqlite_control_scheme();
 
  public:
 	static constexpr auto process_policy() { return tll::channel::Base<T>::ProcessPolicy::Custom; }
 
+	struct StatType : public tll::channel::Base<T>::StatType
+	{
+		tll::stat::IntegerGroup<tll::stat::Ns, 'c', 'k', 'p', 't'> checkpoint;
+		tll::stat::Integer<tll::stat::Last, tll::stat::Bytes, 'w', 'a', 'l'> wal;
+		tll::stat::Integer<tll::stat::Sum, tll::stat::Unknown, 'r', 'o', 'w', 's'> rows; ///< Inserted rows
+		tll::stat::Integer<tll::stat::Sum, tll::stat::Bytes, 'b', 'i', 'n', 'd'> bind; ///< Size of inserted messages
+		tll::stat::IntegerGroup<tll::stat::Ns, 's', 't', 'e', 'p'> step; ///< Insert statement latency
+		tll::stat::IntegerGroup<tll::stat::Ns, 'c', 'o', 'm', 'm', 'i', 't'> commit;
+		tll::stat::IntegerGroup<tll::stat::Unknown, 'r', 'p', 'c'> rpc; ///< Messages per commit
+		tll::stat::Integer<tll::stat::Sum, tll::stat::Unknown, 'b', 'u', 's', 'y'> busy; ///< BUSY or LOCKED results
+	};
+
 	int _init(const tll::Channel::Url &, tll::Channel *master);
 	int _open(const tll::ConstConfig &);
 	int _close();
 
  protected:
-	sqlite3_stmt * _prepare(const std::string_view query)
+	sqlite3_stmt * _prepare(const std::string_view query) { return _prepare(_db.get(), query); }
+
+	sqlite3_stmt * _prepare(sqlite3 * db, const std::string_view query)
 	{
 		this->_log.debug("Prepare SQL statement:\n\t{}", query);
 		sqlite3_stmt * sql = nullptr;
 		const char * tail = nullptr;
-		auto r = sqlite3_prepare_v2(_db.get(), query.data(), query.size(), &sql, &tail);
+		auto r = sqlite3_prepare_v2(db, query.data(), query.size(), &sql, &tail);
 		if (r != SQLITE_OK)
-			return this->_log.fail(nullptr, "Failed to prepare statement: {}\n\t{}", sqlite3_errmsg(_db.get()), query);
+			return this->_log.fail(nullptr, "Failed to prepare statement: {}\n\t{}", sqlite3_errmsg(db), query);
 		return sql;
 	}
 
+	/// Begin transaction if it is not started, return EAGAIN if database is locked in non-blocking mode
+	int _begin()
+	{
+		if (_busy)
+			return EAGAIN;
+		if (_bulk_counter)
+			return 0;
+		if (_busy_policy == BusyPolicy::Fail) {
+			if (sqlite3_exec(_db.get(), "BEGIN", 0, 0, 0))
+				return this->_log.fail(EINVAL, "Failed to begin transaction: {}", sqlite3_errmsg(_db.get()));
+			return 0;
+		}
+
+		// Write lock is taken here so inserts in the transaction never get BUSY
+		auto r = sqlite3_exec(_db.get(), "BEGIN IMMEDIATE", 0, 0, 0);
+		if (r == SQLITE_BUSY || r == SQLITE_LOCKED) {
+			_stat_update([](auto page) { page->busy.update(1); });
+			this->_log.debug("Database is locked, retry later");
+			if (_busy_start(false))
+				return EINVAL;
+			return EAGAIN;
+		}
+		if (r)
+			return this->_log.fail(EINVAL, "Failed to begin transaction: {}", sqlite3_errmsg(_db.get()));
+		_busy_delay = 0;
+		return 0;
+	}
+
+	/// Enter busy state or restart it with longer backoff
+	int _busy_start(bool commit)
+	{
+		_busy_commit = commit;
+		_busy_ticks = 0;
+		_busy_delay = _busy_delay ? std::min(2 * _busy_delay, busy_delay_max) : 1;
+		if (_busy)
+			return 0;
+		_busy = true;
+		if (_busy_timer->open())
+			return this->_log.fail(EINVAL, "Failed to open busy timer");
+		return 0;
+	}
+
+	void _busy_stop()
+	{
+		_busy = false;
+		_busy_commit = false;
+		if (_busy_timer)
+			_busy_timer->close();
+	}
+
+	int _on_busy_timer(const tll::Channel *, const tll_msg_t *msg)
+	{
+		if (msg->type != TLL_MESSAGE_DATA || !_busy)
+			return 0;
+		if (++_busy_ticks < _busy_delay)
+			return 0;
+		if (!_busy_commit) {
+			// Next post retries BEGIN, delay is kept until it succeeds
+			_busy_stop();
+			return 0;
+		}
+		this->_log.debug("Retry commit");
+		if (_commit())
+			return this->state_fail(EINVAL, "Failed to commit transaction");
+		return 0;
+	}
+
+	/// Update channel statistics if enabled, may be called from any thread
+	template <typename F>
+	void _stat_update(F func)
+	{
+		if (!this->_stat_enable)
+			return;
+		auto page = this->channelT()->stat()->acquire();
+		if (!page)
+			return;
+		func(page);
+		this->channelT()->stat()->release(page);
+	}
+
+	/// Step insert statement of one or more rows, account it in stats
+	int _step(sqlite3_stmt * sql, size_t rows, size_t bytes)
+	{
+		if (!this->_stat_enable)
+			return sqlite3_step(sql);
+		auto start = tll::time::now();
+		auto r = sqlite3_step(sql);
+		auto dt = tll::time::now() - start;
+		_stat_update([&](auto page) {
+			page->step.update(dt.count());
+			if (r == SQLITE_DONE) {
+				page->rows.update(rows);
+				page->bind.update(bytes);
+			} else if (r == SQLITE_BUSY || r == SQLITE_LOCKED)
+				page->busy.update(1);
+		});
+		return r;
+	}
+
+	void _checkpoint_run();
+
+	/// Open read-only connection to database of master channel for pool child
+	int _open_pool(const SQLBase<T> &master);
+
+	/// Create periodic timer child channel, it is not opened
+	std::unique_ptr<tll::Channel> _timer_create(std::string_view tag, tll::duration interval)
+	{
+		auto curl = this->child_url_parse(fmt::format("timer://;interval={}ns", interval.count()), tag);
+		if (!curl)
+			return this->_log.fail(nullptr, "Failed to parse {} url: {}", tag, curl.error());
+		auto c = this->context().channel(*curl, this->self());
+		if (!c)
+			return this->_log.fail(nullptr, "Failed to create {} channel", tag);
+		this->_child_add(c.get(), tag);
+		return c;
+	}
+
+	int _pragma(std::string_view pragma)
+	{
+		this->_log.debug("Set connection parameter: {}", pragma);
+		auto str = fmt::format("PRAGMA {}", pragma);
+		if (sqlite3_exec(_db.get(), str.c_str(), 0, 0, 0))
+			return this->_log.fail(EINVAL, "Failed to set '{}': {}", pragma, sqlite3_errmsg(_db.get()));
+		return 0;
+	}
+
+	/// Create index or postpone it until BuildIndex control message or close in bulk load mode.
+	/// Conflict target of REPLACE or upsert is created right away, it is needed to find conflicting rows.
+	/// Other unique indexes are deferred too, duplicates are reported when index is built.
+	int _index_create(const std::string &str, bool conflict = false)
+	{
+		if (_bulk_load && !conflict) {
+			this->_log.debug("Defer index creation:\n\t{}", str);
+			_index_deferred.push_back(str);
+			return 0;
+		}
+		this->_log.debug("Create index:\n\t{}", str);
+		if (sqlite3_exec(_db.get(), str.c_str(), 0, 0, 0))
+			return this->_log.fail(EINVAL, "Failed to create index: {}\n\t{}", sqlite3_errmsg(_db.get()), str);
+		return 0;
+	}
+
+	/// Build all postponed indexes in single transaction, list is kept if build fails
+	int _index_build()
+	{
+		if (_index_deferred.empty())
+			return 0;
+		if (_flush())
+			return EINVAL;
+		if (_busy)
+			return EAGAIN;
+		auto & list = _index_deferred;
+
+		this->_log.info("Build {} deferred indexes", list.size());
+		auto start = tll::time::now();
+		if (sqlite3_exec(_db.get(), "BEGIN", 0, 0, 0))
+			return this->_log.fail(EINVAL, "Failed to begin transaction: {}", sqlite3_errmsg(_db.get()));
+		for (auto & str : list) {
+			this->_log.debug("Create index:\n\t{}", str);
+			if (sqlite3_exec(_db.get(), str.c_str(), 0, 0, 0)) {
+				this->_log.error("Failed to create index: {}\n\t{}", sqlite3_errmsg(_db.get()), str);
+				sqlite3_exec(_db.get(), "ROLLBACK", 0, 0, 0);
+				return EINVAL;
+			}
+		}
+		if (sqlite3_exec(_db.get(), "COMMIT", 0, 0, 0)) {
+			this->_log.error("Failed to commit indexes: {}", sqlite3_errmsg(_db.get()));
+			sqlite3_exec(_db.get(), "ROLLBACK", 0, 0, 0);
+			return EINVAL;
+		}
+		list.clear();
+		this->_log.info("Indexes are built in {}ms", std::chrono::duration_cast<std::chrono::milliseconds>(tll::time::now() - start).count());
+		return 0;
+	}
+
+	/// Hook called before COMMIT, derived channel can write any staged data here
+	int _on_commit() { return 0; }
+
 	int _commit()
 	{
 		this->_log.debug("Commit transaction");
-		if (sqlite3_exec(_db.get(), "COMMIT", 0, 0, 0))
+		if (auto r = this->channelT()->_on_commit(); r)
+			return this->_log.fail(r, "Failed to write staged data");
+		auto start = tll::time::now();
+		auto r = sqlite3_exec(_db.get(), "COMMIT", 0, 0, 0);
+		auto dt = tll::time::now() - start;
+		_stat_update([&](auto page) {
+			if (r == SQLITE_OK) {
+				page->commit.update(dt.count());
+				page->rpc.update(_bulk_counter);
+			} else if (r == SQLITE_BUSY || r == SQLITE_LOCKED)
+				page->busy.update(1);
+		});
+		if ((r == SQLITE_BUSY || r == SQLITE_LOCKED) && _busy_policy == BusyPolicy::EAgain) {
+			if (this->state() == TLL_STATE_ACTIVE) {
+				this->_log.debug("Database is locked, retry commit later");
+				return _busy_start(true);
+			}
+			// Channel is closing, there would be no retry
+			sqlite3_busy_timeout(_db.get(), std::max<long long>(1000, std::chrono::duration_cast<std::chrono::milliseconds>(_busy_timeout).count()));
+			r = sqlite3_exec(_db.get(), "COMMIT", 0, 0, 0);
+		}
+		if (r)
 			return this->_log.fail(EINVAL, "Failed to commit pending transaction: {}", sqlite3_errmsg(_db.get()));
 		_bulk_counter = 0;
+		_bulk_bytes_counter = 0;
+		_busy_delay = 0;
+		if (_busy)
+			_busy_stop();
+		_bulk_last = tll::time::now();
+		if (_bulk_timer && _bulk_timer->state() == TLL_STATE_ACTIVE) {
+			// Restart periodic timer so interval is counted from this commit
+			_bulk_timer->close();
+			if (_bulk_timer->open())
+				return this->_log.fail(EINVAL, "Failed to rearm bulk timer");
+		}
+		return 0;
+	}
+
+	/// Account inserted message and commit if any of bulk limits is reached
+	int _bulk_update(size_t size)
+	{
+		_bulk_bytes_counter += size;
+		++_bulk_counter;
+		if (_bulk_size && _bulk_counter >= _bulk_size)
+			return _commit();
+		if (_bulk_bytes && _bulk_bytes_counter >= _bulk_bytes)
+			return _commit();
+		return 0;
+	}
+
+	/// Commit pending transaction, if any
+	int _flush()
+	{
+		if (!_bulk_counter)
+			return 0;
+		return _commit();
+	}
+
+	/// Handle control messages common for all SQL channels, return ENOENT for unknown ones
+	int _post_control(const tll_msg_t *msg)
+	{
+		if (msg->msgid == sqlite_scheme::Commit::id)
+			return _flush();
+		if (msg->msgid == sqlite_scheme::BuildIndex::id)
+			return _index_build();
+		return ENOENT;
+	}
+
+	/// Post Commit control message to self so channel can route it same way as external one
+	int _on_bulk_timer(const tll::Channel *, const tll_msg_t *msg)
+	{
+		if (msg->type != TLL_MESSAGE_DATA)
+			return 0;
+		tll_msg_t commit = { .type = TLL_MESSAGE_CONTROL, .msgid = sqlite_scheme::Commit::id };
+		if (auto r = this->channelT()->_post(&commit, 0); r && r != EAGAIN)
+			return this->state_fail(EINVAL, "Failed to commit transaction on timeout");
 		return 0;
 	}
 };
@@ -81,9 +392,85 @@ int SQLBase<T>::_init(const tll::Channel::Url &url, tll::Channel * master)
 	_seq_index = reader.getT("seq-index", Index::Unique, {{"no", Index::No}, {"yes", Index::Yes}, {"unique", Index::Unique}});
 	_journal = reader.getT("journal", Journal::Wal, {{"wal", Journal::Wal}, {"default", Journal::Default}});
 	_bulk_size = reader.getT("bulk-size", 0u);
+	_bulk_bytes = reader.getT("bulk-bytes", tll::util::Size { 0 });
+	_bulk_interval = reader.getT("bulk-interval", tll::duration {});
+	_bulk_load = reader.getT("bulk-load", false);
+	_busy_policy = reader.getT("busy-policy", BusyPolicy::Fail, {{"fail", BusyPolicy::Fail}, {"eagain", BusyPolicy::EAgain}});
+	_busy_timeout = reader.getT("busy-timeout", tll::duration {});
+	auto busy_backoff = reader.getT("busy-backoff", tll::duration { std::chrono::milliseconds(1) });
+
+	auto profile = reader.getT("profile", Profile::Default, {{"default", Profile::Default}, {"fast-ingest", Profile::FastIngest}});
+	const bool fast = profile == Profile::FastIngest;
+
+	_page_size = reader.getT("page-size", tll::util::Size { 0 });
+	auto sync = reader.getT("synchronous", _bulk_load ? Synchronous::Off : fast ? Synchronous::Normal : Synchronous::Default,
+			{{"default", Synchronous::Default}, {"off", Synchronous::Off}, {"normal", Synchronous::Normal}, {"full", Synchronous::Full}, {"extra", Synchronous::Extra}});
+	size_t mmap_size = reader.getT("mmap-size", tll::util::Size { fast ? 256 * 1024 * 1024ul : 0ul });
+	auto cache_size = reader.getT("cache-size", fast ? -64 * 1024ll : 0ll);
+	auto temp_store = reader.getT("temp-store", fast ? TempStore::Memory : TempStore::Default,
+			{{"default", TempStore::Default}, {"file", TempStore::File}, {"memory", TempStore::Memory}});
+	auto locking = reader.getT("locking-mode", _bulk_load ? LockingMode::Exclusive : LockingMode::Default,
+			{{"default", LockingMode::Default}, {"normal", LockingMode::Normal}, {"exclusive", LockingMode::Exclusive}});
+	auto autocheckpoint = reader.getT("wal-autocheckpoint", -1ll);
+	_checkpoint = reader.getT("checkpoint", Checkpoint::Auto, {{"auto", Checkpoint::Auto}, {"passive", Checkpoint::Passive},
+			{"full", Checkpoint::Full}, {"restart", Checkpoint::Restart}, {"truncate", Checkpoint::Truncate}});
+	_checkpoint_interval = reader.getT("checkpoint-interval", tll::duration { std::chrono::seconds(1) });
 	if (!reader)
 		return this->_log.fail(EINVAL, "Invalid url: {}", reader.error());
 
+	_pragmas.clear();
+	switch (sync) {
+	case Synchronous::Default: break;
+	case Synchronous::Off: _pragmas.push_back("synchronous=OFF"); break;
+	case Synchronous::Normal: _pragmas.push_back("synchronous=NORMAL"); break;
+	case Synchronous::Full: _pragmas.push_back("synchronous=FULL"); break;
+	case Synchronous::Extra: _pragmas.push_back("synchronous=EXTRA"); break;
+	}
+	if (mmap_size)
+		_pragmas.push_back(fmt::format("mmap_size={}", mmap_size));
+	if (cache_size)
+		_pragmas.push_back(fmt::format("cache_size={}", cache_size));
+	switch (temp_store) {
+	case TempStore::Default: break;
+	case TempStore::File: _pragmas.push_back("temp_store=FILE"); break;
+	case TempStore::Memory: _pragmas.push_back("temp_store=MEMORY"); break;
+	}
+	switch (locking) {
+	case LockingMode::Default: break;
+	case LockingMode::Normal: _pragmas.push_back("locking_mode=NORMAL"); break;
+	case LockingMode::Exclusive: _pragmas.push_back("locking_mode=EXCLUSIVE"); break;
+	}
+	if (_checkpoint != Checkpoint::Auto) {
+		if (autocheckpoint > 0)
+			this->_log.warning("Automatic checkpoints are disabled by checkpoint parameter, ignore wal-autocheckpoint");
+		if (_journal != Journal::Wal)
+			return this->_log.fail(EINVAL, "Checkpoint policy can be used only in WAL mode");
+		// Checkpoint thread uses second connection that can not be opened while database is locked
+		if (locking == LockingMode::Exclusive)
+			return this->_log.fail(EINVAL, "Checkpoint policy can not be used with exclusive locking mode, set locking-mode=normal");
+		autocheckpoint = 0;
+	}
+	if (autocheckpoint >= 0)
+		_pragmas.push_back(fmt::format("wal_autocheckpoint={}", autocheckpoint));
+
+	// Zero bulk size is not limited if transaction is bounded by bytes or interval, otherwise each message is committed
+	if (!_bulk_size && !_bulk_bytes && !_bulk_interval.count())
+		_bulk_size = 1;
+
+	if (_bulk_interval.count() && !_bulk_thread) {
+		_bulk_timer = _timer_create("bulk-timer", _bulk_interval);
+		if (!_bulk_timer)
+			return this->_log.fail(EINVAL, "Failed to create bulk timer");
+		_bulk_timer->template callback_add<SQLBase<T>, &SQLBase<T>::_on_bulk_timer>(this, TLL_MESSAGE_MASK_DATA);
+	}
+
+	if (_busy_policy == BusyPolicy::EAgain) {
+		_busy_timer = _timer_create("busy-timer", busy_backoff);
+		if (!_busy_timer)
+			return this->_log.fail(EINVAL, "Failed to create busy timer");
+		_busy_timer->template callback_add<SQLBase<T>, &SQLBase<T>::_on_busy_timer>(this, TLL_MESSAGE_MASK_DATA);
+	}
+
 	return 0;
 }
 
@@ -91,6 +478,9 @@ template <typename T>
 int SQLBase<T>::_open(const tll::ConstConfig &s)
 {
 	_bulk_counter = 0;
+	_bulk_bytes_counter = 0;
+	_bulk_last = tll::time::now();
+	_index_deferred.clear();
 
 	sqlite3 * db = nullptr;
 	int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
@@ -99,19 +489,141 @@ int SQLBase<T>::_open(const tll::ConstConfig &s)
 		return this->_log.fail(EINVAL, "Failed to open '{}': {}", _path, sqlite3_errstr(r));
 	_db.reset(db, sqlite3_close);
 
+	_busy = false;
+	_busy_commit = false;
+	_busy_delay = 0;
+	if (_busy_timeout.count())
+		sqlite3_busy_timeout(_db.get(), std::chrono::duration_cast<std::chrono::milliseconds>(_busy_timeout).count());
+
+	// Page size can not be changed after database is switched to WAL mode
+	if (_page_size && _pragma(fmt::format("page_size={}", _page_size)))
+		return EINVAL;
+
 	if (_journal == Journal::Wal) {
 		if (sqlite3_exec(_db.get(), "PRAGMA journal_mode=wal", 0, 0, 0))
 			return this->_log.fail(EINVAL, "Failed to change journal_mode to WAL: {}", sqlite3_errmsg(_db.get()));
 	}
 
+	for (auto & p : _pragmas) {
+		if (_pragma(p))
+			return EINVAL;
+	}
+
+	if (_bulk_timer && _bulk_timer->open())
+		return this->_log.fail(EINVAL, "Failed to open bulk timer");
+
+	if (_checkpoint != Checkpoint::Auto) {
+		_checkpoint_stop = false;
+		_checkpoint_thread = std::thread(&SQLBase<T>::_checkpoint_run, this);
+	}
+
 	return 0;
 }
 
+template <typename T>
+int SQLBase<T>::_open_pool(const SQLBase<T> &master)
+{
+	if (master._path.empty() || master._path == ":memory:")
+		return this->_log.fail(EINVAL, "Pool connection needs database file, master path is '{}'", master._path);
+	if (master._journal != Journal::Wal)
+		this->_log.warning("Database of master is not in WAL mode, pool readers block writer");
+	_path = master._path;
+
+	// Connection is used only from processing thread of this channel
+	sqlite3 * db = nullptr;
+	auto r = sqlite3_open_v2(_path.c_str(), &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
+	if (r) {
+		sqlite3_close(db);
+		return this->_log.fail(EINVAL, "Failed to open read-only connection to '{}': {}", _path, sqlite3_errstr(r));
+	}
+	_db.reset(db, sqlite3_close);
+
+	// Only cache parameters of master are relevant for reader
+	for (auto & p : master._pragmas) {
+		for (std::string_view prefix : { "mmap_size=", "cache_size=", "temp_store=" }) {
+			if (p.substr(0, prefix.size()) == prefix && _pragma(p))
+				return EINVAL;
+		}
+	}
+	return 0;
+}
+
+template <typename T>
+void SQLBase<T>::_checkpoint_run()
+{
+	sqlite3 * db = nullptr;
+	if (auto r = sqlite3_open_v2(_path.c_str(), &db, SQLITE_OPEN_READWRITE, nullptr); r) {
+		this->_log.error("Failed to open checkpoint connection to '{}': {}", _path, sqlite3_errstr(r));
+		sqlite3_close(db);
+		return;
+	}
+
+	int mode = SQLITE_CHECKPOINT_PASSIVE;
+	switch (_checkpoint) {
+	case Checkpoint::Auto:
+	case Checkpoint::Passive: mode = SQLITE_CHECKPOINT_PASSIVE; break;
+	case Checkpoint::Full: mode = SQLITE_CHECKPOINT_FULL; break;
+	case Checkpoint::Restart: mode = SQLITE_CHECKPOINT_RESTART; break;
+	case Checkpoint::Truncate: mode = SQLITE_CHECKPOINT_TRUNCATE; break;
+	}
+
+	long long page_size = 4096;
+	{
+		sqlite3_stmt * sql = nullptr;
+		if (sqlite3_prepare_v2(db, "PRAGMA page_size", -1, &sql, nullptr) == SQLITE_OK && sqlite3_step(sql) == SQLITE_ROW)
+			page_size = sqlite3_column_int64(sql, 0);
+		sqlite3_finalize(sql);
+	}
+
+	this->_log.debug("Checkpoint thread started, interval {}ms", std::chrono::duration_cast<std::chrono::milliseconds>(_checkpoint_interval).count());
+	std::unique_lock<std::mutex> lock(_checkpoint_lock);
+	while (!_checkpoint_stop) {
+		if (_checkpoint_cond.wait_for(lock, _checkpoint_interval, [this]() { return _checkpoint_stop; }))
+			break;
+		lock.unlock();
+
+		int frames = 0, done = 0;
+		auto start = tll::time::now();
+		auto r = sqlite3_wal_checkpoint_v2(db, nullptr, mode, &frames, &done);
+		auto dt = tll::time::now() - start;
+		if (r == SQLITE_OK)
+			this->_log.trace("WAL checkpoint: {} frames, {} done in {}us", frames, done, std::chrono::duration_cast<std::chrono::microseconds>(dt).count());
+		else if (r != SQLITE_BUSY)
+			this->_log.warning("WAL checkpoint failed: {}", sqlite3_errmsg(db));
+
+		_stat_update([&](auto page) {
+			page->checkpoint.update(dt.count());
+			page->wal.update(std::max(frames, 0) * page_size);
+		});
+
+		lock.lock();
+	}
+
+	sqlite3_close(db);
+	this->_log.debug("Checkpoint thread finished");
+}
+
 template <typename T>
 int SQLBase<T>::_close()
 {
+	if (_checkpoint_thread.joinable()) {
+		{
+			std::unique_lock<std::mutex> lock(_checkpoint_lock);
+			_checkpoint_stop = true;
+			_checkpoint_cond.notify_one();
+		}
+		_checkpoint_thread.join();
+	}
+	if (_bulk_timer)
+		_bulk_timer->close();
+	if (_busy_timer)
+		_busy_timer->close();
+	_busy = false;
 	if (_bulk_counter)
 		_commit();
+	if (_db)
+		_index_build();
+	_index_deferred.clear();
 	_db.reset();
 	return 0;
 }
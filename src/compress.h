@@ -0,0 +1,245 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fmt/format.h>
+
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_LZ4
+#include <lz4.h>
+#endif
+
+namespace sqlite_compress {
+
+/// Codec of compressed column. Compressor is immutable and can be shared between threads,
+/// compression contexts are kept per thread and reused for all columns.
+class Compressor
+{
+ public:
+	virtual ~Compressor() = default;
+
+	/// Replace buffer content with compressed data
+	virtual int compress(std::string_view data, std::vector<unsigned char> &out) const = 0;
+	/// Size of decompressed data, -1 if frame is invalid
+	virtual long long size(std::string_view data) const = 0;
+	/// Decompress data into buffer of exactly size() bytes
+	virtual int decompress(std::string_view data, void * out, size_t size) const = 0;
+};
+
+inline int read_file(std::string_view path, std::string &data, std::string &error)
+{
+	std::ifstream f { std::string(path), std::ios::binary };
+	if (!f) {
+		error = fmt::format("Failed to open dictionary file '{}'", path);
+		return EINVAL;
+	}
+	data.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+	if (f.bad() || data.empty()) {
+		error = fmt::format("Failed to read dictionary file '{}'", path);
+		return EINVAL;
+	}
+	return 0;
+}
+
+#ifdef WITH_ZSTD
+class Zstd : public Compressor
+{
+	struct cdict_delete { void operator ()(ZSTD_CDict *ptr) const { ZSTD_freeCDict(ptr); } };
+	struct ddict_delete { void operator ()(ZSTD_DDict *ptr) const { ZSTD_freeDDict(ptr); } };
+
+	int _level = 0;
+	std::unique_ptr<ZSTD_CDict, cdict_delete> _cdict;
+	std::unique_ptr<ZSTD_DDict, ddict_delete> _ddict;
+
+	struct context_t
+	{
+		ZSTD_CCtx * cctx = ZSTD_createCCtx();
+		ZSTD_DCtx * dctx = ZSTD_createDCtx();
+		~context_t() { ZSTD_freeCCtx(cctx); ZSTD_freeDCtx(dctx); }
+	};
+
+	static context_t & context() { static thread_local context_t ctx; return ctx; }
+
+ public:
+	int init(int level, std::string_view dict, std::string &error)
+	{
+		_level = level;
+		if (dict.empty())
+			return 0;
+		std::string data;
+		if (read_file(dict, data, error))
+			return EINVAL;
+		_cdict.reset(ZSTD_createCDict(data.data(), data.size(), level));
+		_ddict.reset(ZSTD_createDDict(data.data(), data.size()));
+		if (!_cdict || !_ddict) {
+			error = fmt::format("Failed to load zstd dictionary '{}'", dict);
+			return EINVAL;
+		}
+		return 0;
+	}
+
+	int compress(std::string_view data, std::vector<unsigned char> &out) const override
+	{
+		auto & ctx = context();
+		out.resize(ZSTD_compressBound(data.size()));
+		size_t r = 0;
+		if (_cdict)
+			r = ZSTD_compress_usingCDict(ctx.cctx, out.data(), out.size(), data.data(), data.size(), _cdict.get());
+		else
+			r = ZSTD_compressCCtx(ctx.cctx, out.data(), out.size(), data.data(), data.size(), _level);
+		if (ZSTD_isError(r))
+			return EINVAL;
+		out.resize(r);
+		return 0;
+	}
+
+	long long size(std::string_view data) const override
+	{
+		auto r = ZSTD_getFrameContentSize(data.data(), data.size());
+		if (r == ZSTD_CONTENTSIZE_UNKNOWN || r == ZSTD_CONTENTSIZE_ERROR)
+			return -1;
+		return r;
+	}
+
+	int decompress(std::string_view data, void * out, size_t size) const override
+	{
+		auto & ctx = context();
+		size_t r = 0;
+		if (_ddict)
+			r = ZSTD_decompress_usingDDict(ctx.dctx, out, size, data.data(), data.size(), _ddict.get());
+		else
+			r = ZSTD_decompressDCtx(ctx.dctx, out, size, data.data(), data.size());
+		if (ZSTD_isError(r) || r != size)
+			return EINVAL;
+		return 0;
+	}
+};
+#endif
+
+#ifdef WITH_LZ4
+/// LZ4 block prefixed with 4 byte little endian size of decompressed data
+class Lz4 : public Compressor
+{
+	static constexpr size_t prefix = sizeof(uint32_t);
+
+	int _acceleration = 1;
+	std::string _dict;
+	LZ4_stream_t _dict_stream; ///< Stream with loaded dictionary, copied into working stream for each value
+
+	struct context_t
+	{
+		LZ4_stream_t stream;
+		context_t() { LZ4_initStream(&stream, sizeof(stream)); }
+	};
+
+	static context_t & context() { static thread_local context_t ctx; return ctx; }
+
+ public:
+	int init(int level, std::string_view dict, std::string &error)
+	{
+		_acceleration = level > 0 ? level : 1;
+		if (dict.empty())
+			return 0;
+		if (read_file(dict, _dict, error))
+			return EINVAL;
+		// Only last 64kb of dictionary are used by lz4
+		if (_dict.size() > 64 * 1024)
+			_dict.erase(0, _dict.size() - 64 * 1024);
+		LZ4_initStream(&_dict_stream, sizeof(_dict_stream));
+		LZ4_loadDict(&_dict_stream, _dict.data(), _dict.size());
+		return 0;
+	}
+
+	int compress(std::string_view data, std::vector<unsigned char> &out) const override
+	{
+		if (data.size() > LZ4_MAX_INPUT_SIZE)
+			return EMSGSIZE;
+		auto & ctx = context();
+		const int bound = LZ4_compressBound(data.size());
+		out.resize(prefix + bound);
+		const uint32_t size = data.size();
+		for (auto i = 0u; i < prefix; i++)
+			out[i] = (size >> (8 * i)) & 0xff;
+		auto dst = (char *) out.data() + prefix;
+		int r = 0;
+		if (_dict.size()) {
+			// Copy of preloaded state is cheaper than hashing dictionary again,
+			// LZ4_attach_dictionary is not exported from shared library
+			memcpy(&ctx.stream, &_dict_stream, sizeof(ctx.stream));
+			r = LZ4_compress_fast_continue(&ctx.stream, data.data(), dst, data.size(), bound, _acceleration);
+		} else
+			r = LZ4_compress_fast_extState(&ctx.stream, data.data(), dst, data.size(), bound, _acceleration);
+		if (r <= 0)
+			return EINVAL;
+		out.resize(prefix + r);
+		return 0;
+	}
+
+	long long size(std::string_view data) const override
+	{
+		if (data.size() < prefix)
+			return -1;
+		uint32_t size = 0;
+		for (auto i = 0u; i < prefix; i++)
+			size |= (uint32_t) (unsigned char) data[i] << (8 * i);
+		return size;
+	}
+
+	int decompress(std::string_view data, void * out, size_t size) const override
+	{
+		if (data.size() < prefix)
+			return EINVAL;
+		data.remove_prefix(prefix);
+		int r = 0;
+		if (_dict.size())
+			r = LZ4_decompress_safe_usingDict(data.data(), (char *) out, data.size(), size, _dict.data(), _dict.size());
+		else
+			r = LZ4_decompress_safe(data.data(), (char *) out, data.size(), size);
+		if (r < 0 || (size_t) r != size)
+			return EINVAL;
+		return 0;
+	}
+};
+#endif
+
+/// Create compressor for codec name, level is codec specific: zstd compression level or lz4 acceleration.
+/// Dictionary is path to file with raw or trained dictionary, empty if not used.
+inline std::shared_ptr<const Compressor> create(std::string_view codec, int level, std::string_view dict, std::string &error)
+{
+	if (codec == "zstd") {
+#ifdef WITH_ZSTD
+		auto c = std::make_shared<Zstd>();
+		if (c->init(level, dict, error))
+			return nullptr;
+		return c;
+#else
+		error = "zstd compression is not enabled in this build";
+		return nullptr;
+#endif
+	} else if (codec == "lz4") {
+#ifdef WITH_LZ4
+		auto c = std::make_shared<Lz4>();
+		if (c->init(level, dict, error))
+			return nullptr;
+		return c;
+#else
+		error = "lz4 compression is not enabled in this build";
+		return nullptr;
+#endif
+	}
+	error = fmt::format("Unknown compression codec '{}', expected zstd or lz4", codec);
+	return nullptr;
+}
+
+}
+
+#endif//_COMPRESS_H
@@ -7,6 +7,10 @@
 
 #include <sqlite3.h>
 
+#include <limits>
+#include <map>
+#include <optional>
+#include <set>
 #include <variant>
 
 #include <tll/channel/base.h>
@@ -16,6 +20,8 @@
 #include <tll/util/string.h>
 
 #include "common.h"
+#include "compress.h"
+#include "sqlite-scheme.h"
 
 using namespace tll;
 
@@ -27,12 +33,26 @@ class JSQLite : public SQLBase<JSQLite>
 	query_ptr_t _insert;
 
 	JSQLite * master = nullptr;
-	std::string _path;
 	std::string _table;
 	std::vector<std::variant<std::string, long long, double>> _query;
-	bool _autoclose;
+	bool _autoclose = false;
 
-	tll::json::JSON * json() { if (master) return &master->_json; return &_json; }
+	/// Storage format of data column, binary JSONB needs sqlite 3.45
+	enum class Format { Text, Jsonb };
+	Format _format = Format::Text;
+
+	bool _msgid_column = true; ///< Table has integer msgid column, legacy tables have only message name
+	bool _name_column = false; ///< Legacy name column is present and filled on insert
+
+	enum class Generated { Virtual, Stored };
+	Generated _generated = Generated::Virtual; ///< Storage of generated columns for sql.index keys
+	std::set<std::string, std::less<>> _columns; ///< Table columns, including generated ones
+
+	std::shared_ptr<const sqlite_compress::Compressor> _compress; ///< Codec of data column, stored as BLOB
+	std::vector<unsigned char> _compress_buf;
+
+	/// Pool children decode on their own thread and need separate JSON buffers
+	tll::json::JSON * json() { if (master && !_pool) return &master->_json; return &_json; }
 
  public:
 	static constexpr std::string_view sqlite_control_scheme()
@@ -40,6 +60,12 @@ class JSQLite : public SQLBase<JSQLite>
 		return R"(yamls://
 - name: EOD
   id: 1
+
+- name: Commit
+  id: 3
+
+- name: BuildIndex
+  id: 6
 )";
 	}
 
@@ -56,6 +82,44 @@ class JSQLite : public SQLBase<JSQLite>
  private:
 	int _create_table();
 	int _create_index(const std::string_view &name, const std::string_view &key);
+	int _table_columns(std::set<std::string, std::less<>> &columns);
+	int _migrate_msgid();
+
+	/// Expression for value of dotted key in data column, same text is used in queries and indexes
+	static std::string _json_path(std::string_view key) { return fmt::format("json_extract(data, \"$.{}\")", key); }
+	/// Name of generated column holding value of dotted key
+	static std::string _generated_column(std::string_view key) { return fmt::format("$.{}", key); }
+	/// Statement creating unique key index of message, name of index is json_{table}_{message}
+	std::string _key_index(const tll::scheme::Message &msg, std::string_view key)
+	{
+		return fmt::format("CREATE UNIQUE INDEX `json_{}_{}` on `{}`({}) WHERE `msgid`={}", _table, msg.name, _table, _json_path(key), msg.msgid);
+	}
+
+	/// Generated column for key if table has one, otherwise json_extract expression
+	std::string _query_path(std::string_view key)
+	{
+		auto column = _generated_column(key);
+		if (_columns.count(column))
+			return fmt::format("`{}`", column);
+		return _json_path(key);
+	}
+
+	static std::string_view _strip(std::string_view s)
+	{
+		while (s.size() && s.front() == ' ') s.remove_prefix(1);
+		while (s.size() && s.back() == ' ') s.remove_suffix(1);
+		return s;
+	}
+
+	/// SQL operator for key suffix: eq, ne, gt, ge, lt, le, in or between
+	static std::optional<std::string_view> _query_op(std::string_view name);
+	/// Resolve dotted key to message field, without message only key syntax is checked
+	int _query_field(const tll::scheme::Message * msg, std::string_view key, const tll::scheme::Field * &field);
+	/// Convert value to type of the field and add it to query parameters
+	int _query_value(const tll::scheme::Field * field, std::string_view key, std::string_view v);
+
+	/// Keys listed in sql.index option of message
+	static std::vector<std::string_view> _index_keys(const tll::scheme::Message &msg);
 };
 
 int JSQLite::_init(const Channel::Url &url, Channel * master)
@@ -65,6 +129,17 @@ int JSQLite::_init(const Channel::Url &url, Channel * master)
 		if (!this->master)
 			return _log.fail(EINVAL, "Parent {} must be jsqlite:// channel", master->name());
 		_table = this->master->_table;
+		_format = this->master->_format;
+		_compress = this->master->_compress;
+
+		auto reader = channel_props_reader(url);
+		_pool = reader.getT("pool", false);
+		if (_pool)
+			_autoclose = reader.getT("autoclose", false);
+		if (!reader)
+			return _log.fail(EINVAL, "Invalid url: {}", reader.error());
+		if (_pool && (internal.caps & caps::Output))
+			return _log.fail(EINVAL, "Pool channel has read-only connection and can not be opened for writing");
 		return 0;
 	}
 
@@ -72,26 +147,49 @@ int JSQLite::_init(const Channel::Url &url, Channel * master)
 	//if (_json.init(reader))
 	//	return _log.fail(EINVAL, "Failed to init JSON encoder");
 	_table = reader.getT<std::string>("table");
+	_format = reader.getT("format", Format::Text, {{"text", Format::Text}, {"jsonb", Format::Jsonb}});
+	_generated = reader.getT("generated-column", Generated::Virtual, {{"virtual", Generated::Virtual}, {"stored", Generated::Stored}});
+	auto compress = reader.getT<std::string>("compress", "no");
+	auto compress_level = reader.getT("compress-level", 0);
+	auto compress_dict = reader.getT<std::string>("compress-dict", "");
 	if ((internal.caps & (caps::Input | caps::Output)) == caps::Input)
 		_autoclose = reader.getT("autoclose", false);
 	if (!reader)
 		return _log.fail(EINVAL, "Invalid url: {}", reader.error());
 
+	_compress.reset();
+	if (compress != "no") {
+		if (_format == Format::Jsonb)
+			return _log.fail(EINVAL, "Compression can not be used with jsonb format");
+		std::string error;
+		_compress = sqlite_compress::create(compress, compress_level, compress_dict, error);
+		if (!_compress)
+			return _log.fail(EINVAL, "Invalid compression: {}", error);
+	}
+
+	if (_format == Format::Jsonb && sqlite3_libversion_number() < 3045000) {
+		_log.warning("JSONB is not supported by sqlite {}, fallback to text format", sqlite3_libversion());
+		_format = Format::Text;
+	}
+
 	return SQLBase<JSQLite>::_init(url, master);
 }
 
 int JSQLite::_open(const ConstConfig &s)
 {
 	if (master) {
-		_db = master->_db;
 		auto s = master->self()->scheme();
 		if (!s)
 			return _log.fail(EINVAL, "Parent {} without scheme", master->self()->name());
 		_scheme.reset(s->copy());
-		return 0;
-	}
+		if (!_pool) {
+			_db = master->_db;
+			return 0;
+		}
 
-	if (auto r = SQLBase<JSQLite>::_open(s); r)
+		if (auto r = _open_pool(*master); r)
+			return _log.fail(r, "Failed to open pool connection");
+	} else if (auto r = SQLBase<JSQLite>::_open(s); r)
 		return _log.fail(r, "Failed to open SQLite database");
 
 	if (_json.init_scheme(_scheme.get()))
@@ -101,25 +199,47 @@ int JSQLite::_open(const ConstConfig &s)
 		if (_create_table())
 			return _log.fail(EINVAL, "Failed to create table '{}'", _table);
 
-		auto str = fmt::format("REPLACE INTO `{}`(`seq`, `name`, `data`) VALUES (?, ?, ?)", _table);
+		std::string_view data = _format == Format::Jsonb ? "jsonb(?)" : "?";
+		std::string_view name = _name_column ? "`name`, " : "";
+		std::string_view value = _name_column ? "?, " : "";
+		auto str = fmt::format("REPLACE INTO `{}`(`seq`, {}`msgid`, `data`) VALUES (?, {}?, {})", _table, name, value, data);
 		_insert.reset(_prepare(str));
 		if (!_insert)
 			return _log.fail(EINVAL, "Failed to prepare REPLACE statement");
 	}
 
 	if (internal.caps & caps::Input) {
-		auto str = fmt::format("SELECT `seq`, `name`, `data` FROM `{}`", _table);
+		if (!(internal.caps & caps::Output)) {
+			_columns.clear();
+			if (_table_columns(_columns))
+				return EINVAL;
+			_msgid_column = _columns.empty() || _columns.count("msgid");
+			if (!_msgid_column)
+				_log.info("Table {} has no msgid column, lookup messages by name", _table);
+		}
+
+		// Table may contain both text and binary rows, json() converts them to text
+		std::string_view data = _format == Format::Jsonb ? "json(`data`)" : "`data`";
+		std::string_view id = _msgid_column ? "`msgid`" : "`name`";
+		auto str = fmt::format("SELECT `seq`, {}, {} FROM `{}`", id, data, _table);
 		auto name = s.get("query");
 		_query.clear();
+		const tll::scheme::Message * msg = nullptr;
 		if (name) {
-			str += " WHERE `name`= ?";
-			_query.push_back(std::string(*name));
-			auto msg = json()->lookup(*name);
+			msg = json()->lookup(*name);
 			if (!msg)
 				return _log.fail(ENOENT, "Query for message not in scheme: '{}'", *name);
+			// Literal msgid is needed for partial indexes to be used by planner
+			if (_msgid_column)
+				str += fmt::format(" WHERE `msgid` = {}", msg->msgid);
+			else
+				str += " WHERE `name` = ?";
+			_query.push_back(std::string(*name));
 		}
 
 		for (auto & [k,cfg] : s.browse("query.**")) {
+			if (_compress)
+				return _log.fail(EINVAL, "Query by key '{}' is not possible, data column is compressed", k);
 			if (!_query.size())
 				_log.warning("Query without message name, string comparison");
 			auto value = cfg.get();
@@ -129,63 +249,98 @@ int JSQLite::_open(const ConstConfig &s)
 			_log.debug("Query: {}={}", k, v);
 			std::string_view sep = _query.size()?"AND":"WHERE";
 			auto key = k.substr(strlen("query."));
-			str += fmt::format(" {} json_extract(data, \"$.{}\") = ?", sep, key);
-			if (!name) {
-				_query.push_back(std::string(v));
-				continue;
-			}
-			auto msg = json()->lookup(*name);
-			using namespace tll::scheme;
-			const Field * field = nullptr;
-
-			for (auto i : tll::split<'.'>(key)) {
-				if (field && field->type != Field::Message)
-					return _log.fail(EINVAL, "Invalid key '{}': message '{}' field '{}' is not submessage", key, msg->name, i);
-				auto m = field?field->type_msg:msg;
-				auto meta = static_cast<const json::message_meta_t *>(m->user);
-				if (!meta)
-					return _log.fail(EINVAL, "Message without metadata: {}", m->name);
-				auto it = meta->index.find(i);
-				if (it == meta->index.end())
-					return _log.fail(EINVAL, "Invalid key '{}': message '{}' has no field '{}'", key, m->name, i);
-				field = it->second;
-			}
 
-			switch(field->type) {
-			case Field::Int8:
-			case Field::Int16:
-			case Field::Int32:
-			case Field::Int64: {
-				auto r = conv::to_any<long long>(v);
+			// Operator is given as key suffix: query.field:gt=10, plain key is equality
+			std::string_view op = "=";
+			if (auto pos = key.find(':'); pos != key.npos) {
+				auto r = _query_op(key.substr(pos + 1));
 				if (!r)
-					return _log.fail(EINVAL, "Invalid integer value for key '{}' '{}': {}", key, v, r.error());
-				_query.push_back(*r);
-				break;
+					return _log.fail(EINVAL, "Invalid operator '{}' for key '{}'", key.substr(pos + 1), key.substr(0, pos));
+				op = *r;
+				key = key.substr(0, pos);
 			}
-			case Field::Double: {
-				auto r = conv::to_any<double>(v);
-				if (!r)
-					return _log.fail(EINVAL, "Invalid double value for key '{}' '{}': {}", key, v, r.error());
-				_query.push_back(*r);
-				break;
+
+			const tll::scheme::Field * field = nullptr;
+			if (_query_field(msg, key, field))
+				return EINVAL;
+
+			std::vector<std::string_view> values;
+			if (op == "IN" || op == "BETWEEN") {
+				for (auto i : tll::split<','>(v))
+					values.push_back(_strip(i));
+			} else
+				values.push_back(v);
+
+			if (op == "BETWEEN" && values.size() != 2)
+				return _log.fail(EINVAL, "Invalid between condition for key '{}', need two values: '{}'", key, *value);
+			for (auto & i : values) {
+				if (_query_value(field, key, i))
+					return EINVAL;
 			}
-			default:
-				_query.push_back(std::string(v));
-				break;
+
+			if (op == "IN") {
+				std::string list;
+				for (auto i = 0u; i < values.size(); i++)
+					list += i ? ", ?" : "?";
+				str += fmt::format(" {} {} IN ({})", sep, _query_path(key), list);
+			} else if (op == "BETWEEN")
+				str += fmt::format(" {} {} BETWEEN ? AND ?", sep, _query_path(key));
+			else
+				str += fmt::format(" {} {} {} ?", sep, _query_path(key), op);
+		}
+
+		if (auto order = s.get("order-by"); order) {
+			std::string list;
+			for (auto i : tll::split<','>(*order)) {
+				i = _strip(i);
+				if (i.empty()) continue;
+				auto sp = i.find(' ');
+				auto key = _strip(i.substr(0, sp));
+				std::string_view dir = sp == i.npos ? "" : _strip(i.substr(sp));
+				if (dir == "asc" || dir == "ASC")
+					dir = " ASC";
+				else if (dir == "desc" || dir == "DESC")
+					dir = " DESC";
+				else if (dir.size())
+					return _log.fail(EINVAL, "Invalid order direction for key '{}': '{}'", key, dir);
+				if (key != "seq") {
+					if (_compress)
+						return _log.fail(EINVAL, "Order by key '{}' is not possible, data column is compressed", key);
+					const tll::scheme::Field * field = nullptr;
+					if (_query_field(msg, key, field))
+						return EINVAL;
+				}
+				if (list.size())
+					list += ", ";
+				list += (key == "seq" ? std::string("`seq`") : _query_path(key)) + std::string(dir);
 			}
+			if (list.size())
+				str += " ORDER BY " + list;
 		}
 
+		if (auto limit = s.get("limit"); limit) {
+			auto r = conv::to_any<long long>(*limit);
+			if (!r)
+				return _log.fail(EINVAL, "Invalid limit '{}': {}", *limit, r.error());
+			str += " LIMIT ?";
+			_query.push_back(*r);
+		}
+
+		_log.debug("Select statement: {}", str);
 		_select.reset(_prepare(str));
 		if (!_select)
 			return _log.fail(EINVAL, "Failed to prepare SELECT statement");
+		int idx = 1;
 		for (auto i = 0u; i < _query.size(); i++) {
 			auto & v = _query[i];
+			if (i == 0 && name && _msgid_column)
+				continue;
 			if (std::holds_alternative<std::string>(v))
-				sqlite3_bind_text(_select.get(), 1 + i, std::get<std::string>(v).data(), std::get<std::string>(v).size(), SQLITE_STATIC);
+				sqlite3_bind_text(_select.get(), idx++, std::get<std::string>(v).data(), std::get<std::string>(v).size(), SQLITE_STATIC);
 			else if (std::holds_alternative<long long>(v))
-				sqlite3_bind_int64(_select.get(), 1 + i, std::get<long long>(v));
+				sqlite3_bind_int64(_select.get(), idx++, std::get<long long>(v));
 			else if (std::holds_alternative<double>(v))
-				sqlite3_bind_double(_select.get(), 1 + i, std::get<double>(v));
+				sqlite3_bind_double(_select.get(), idx++, std::get<double>(v));
 		}
 		_update_dcaps(dcaps::Process | dcaps::Pending);
 	}
@@ -193,34 +348,242 @@ int JSQLite::_open(const ConstConfig &s)
 	return 0;
 }
 
-int JSQLite::_create_table()
+std::optional<std::string_view> JSQLite::_query_op(std::string_view name)
 {
-	query_ptr_t sql;
+	static const std::map<std::string_view, std::string_view> ops = {
+		{"eq", "="}, {"ne", "!="}, {"gt", ">"}, {"ge", ">="}, {"lt", "<"}, {"le", "<="}, {"in", "IN"}, {"between", "BETWEEN"},
+	};
+	auto it = ops.find(name);
+	if (it == ops.end())
+		return std::nullopt;
+	return it->second;
+}
 
-	sql.reset(_prepare("SELECT name FROM sqlite_master WHERE name=?"));
-	if (!sql)
-		return _log.fail(EINVAL, "Failed to prepare check statement");
+int JSQLite::_query_field(const tll::scheme::Message * msg, std::string_view key, const tll::scheme::Field * &field)
+{
+	using namespace tll::scheme;
+	field = nullptr;
+	if (!msg) {
+		// Key is inserted into SQL text, without scheme only plain dotted names are allowed
+		for (auto c : key) {
+			if (!isalnum((unsigned char) c) && c != '_' && c != '.')
+				return _log.fail(EINVAL, "Invalid key '{}'", key);
+		}
+		return key.empty() ? _log.fail(EINVAL, "Empty key") : 0;
+	}
+	for (auto i : tll::split<'.'>(key)) {
+		if (field && field->type != Field::Message)
+			return _log.fail(EINVAL, "Invalid key '{}': message '{}' field '{}' is not submessage", key, msg->name, i);
+		auto m = field?field->type_msg:msg;
+		auto meta = static_cast<const json::message_meta_t *>(m->user);
+		if (!meta)
+			return _log.fail(EINVAL, "Message without metadata: {}", m->name);
+		auto it = meta->index.find(i);
+		if (it == meta->index.end())
+			return _log.fail(EINVAL, "Invalid key '{}': message '{}' has no field '{}'", key, m->name, i);
+		field = it->second;
+	}
+	return 0;
+}
 
-	sqlite3_bind_text(sql.get(), 1, _table.data(), _table.size(), SQLITE_STATIC);
-	auto r = sqlite3_step(sql.get());
-	if (r == SQLITE_ROW) {
-		_log.debug("Table '{}' exists", _table);
-		return 0;
-	} else if (r != SQLITE_DONE)
-		return _log.fail(EINVAL, "Failed to check table '{}'", _table);
+int JSQLite::_query_value(const tll::scheme::Field * field, std::string_view key, std::string_view v)
+{
+	using tll::scheme::Field;
+	switch (field ? field->type : Field::Bytes) {
+	case Field::Int8:
+	case Field::Int16:
+	case Field::Int32:
+	case Field::Int64:
+	case Field::UInt8:
+	case Field::UInt16:
+	case Field::UInt32: {
+		auto r = conv::to_any<long long>(v);
+		if (!r)
+			return _log.fail(EINVAL, "Invalid integer value for key '{}' '{}': {}", key, v, r.error());
+		_query.push_back(*r);
+		break;
+	}
+	case Field::UInt64: {
+		auto r = conv::to_any<unsigned long long>(v);
+		if (!r)
+			return _log.fail(EINVAL, "Invalid integer value for key '{}' '{}': {}", key, v, r.error());
+		// Values above int64 range are extracted from JSON as real numbers
+		if (*r > (unsigned long long) std::numeric_limits<long long>::max())
+			_query.push_back((double) *r);
+		else
+			_query.push_back((long long) *r);
+		break;
+	}
+	case Field::Double: {
+		auto r = conv::to_any<double>(v);
+		if (!r)
+			return _log.fail(EINVAL, "Invalid double value for key '{}' '{}': {}", key, v, r.error());
+		_query.push_back(*r);
+		break;
+	}
+	default:
+		_query.push_back(std::string(v));
+		break;
+	}
+	return 0;
+}
 
-	_log.info("Create table '{}'", _table);
-	sql.reset(_prepare(fmt::format("CREATE TABLE `{}` (`seq` INTEGER, `name` VARCHAR NOT NULL, `data` TEXT)", _table)));
+int JSQLite::_table_columns(std::set<std::string, std::less<>> &columns)
+{
+	query_ptr_t sql;
+	sql.reset(_prepare(fmt::format("PRAGMA table_xinfo(`{}`)", _table)));
 	if (!sql)
-		return _log.fail(EINVAL, "Failed to prepare CREATE statement");
+		return _log.fail(EINVAL, "Failed to prepare table info statement");
+	int r = SQLITE_ROW;
+	while ((r = sqlite3_step(sql.get())) == SQLITE_ROW)
+		columns.emplace((const char *) sqlite3_column_text(sql.get(), 1), sqlite3_column_bytes(sql.get(), 1));
+	if (r != SQLITE_DONE)
+		return _log.fail(EINVAL, "Failed to get columns of table '{}': {}", _table, sqlite3_errmsg(_db.get()));
+	return 0;
+}
+
+int JSQLite::_migrate_msgid()
+{
+	_log.info("Add msgid column to table '{}'", _table);
+	std::string cases;
+	for (auto & m : tll::util::list_wrap(_scheme->messages)) {
+		if (m.msgid)
+			cases += fmt::format(" WHEN '{}' THEN {}", m.name, m.msgid);
+	}
 
-	if (sqlite3_step(sql.get()) != SQLITE_DONE)
-		return _log.fail(EINVAL, "Failed to create table '{}'", _table);
+	std::set<std::string, std::less<>> indexes;
+	{
+		query_ptr_t sql;
+		sql.reset(_prepare(fmt::format("PRAGMA index_list(`{}`)", _table)));
+		if (!sql)
+			return _log.fail(EINVAL, "Failed to prepare index list statement");
+		int r = SQLITE_ROW;
+		while ((r = sqlite3_step(sql.get())) == SQLITE_ROW)
+			indexes.emplace((const char *) sqlite3_column_text(sql.get(), 1), sqlite3_column_bytes(sql.get(), 1));
+		if (r != SQLITE_DONE)
+			return _log.fail(EINVAL, "Failed to list indexes of table '{}': {}", _table, sqlite3_errmsg(_db.get()));
+	}
 
+	if (sqlite3_exec(_db.get(), "BEGIN", 0, 0, 0))
+		return _log.fail(EINVAL, "Failed to begin transaction: {}", sqlite3_errmsg(_db.get()));
+	auto str = fmt::format("ALTER TABLE `{}` ADD COLUMN `msgid` INTEGER", _table);
+	if (cases.size())
+		str += fmt::format("; UPDATE `{}` SET `msgid` = CASE `name`{} END", _table, cases);
+	// Legacy key indexes filter rows by name and are not used by queries on msgid
 	for (auto & m : tll::util::list_wrap(_scheme->messages)) {
 		auto key = scheme::options_map(m.options).get("key");
-		if (!key) continue;
-		_create_index(m.name, *key);
+		if (!key || !m.msgid)
+			continue;
+		auto index = fmt::format("json_{}_{}", _table, m.name);
+		if (!indexes.count(index))
+			continue;
+		_log.info("Recreate index '{}' with msgid condition", index);
+		str += fmt::format("; DROP INDEX `{}`; {}", index, _key_index(m, *key));
+	}
+	if (sqlite3_exec(_db.get(), str.c_str(), 0, 0, 0)) {
+		_log.error("Failed to migrate table '{}': {}", _table, sqlite3_errmsg(_db.get()));
+		sqlite3_exec(_db.get(), "ROLLBACK", 0, 0, 0);
+		return EINVAL;
+	}
+	if (sqlite3_exec(_db.get(), "COMMIT", 0, 0, 0))
+		return _log.fail(EINVAL, "Failed to commit migration: {}", sqlite3_errmsg(_db.get()));
+	return 0;
+}
+
+std::vector<std::string_view> JSQLite::_index_keys(const tll::scheme::Message &msg)
+{
+	std::vector<std::string_view> r;
+	auto list = scheme::options_map(msg.options).get("sql.index");
+	if (!list)
+		return r;
+	for (auto k : tll::split<','>(*list)) {
+		if (k = _strip(k); k.size())
+			r.push_back(k);
+	}
+	return r;
+}
+
+int JSQLite::_create_table()
+{
+	_columns.clear();
+	if (_table_columns(_columns))
+		return EINVAL;
+
+	std::set<std::string_view> keys;
+	for (auto & m : tll::util::list_wrap(_scheme->messages)) {
+		for (auto & k : _index_keys(m))
+			keys.insert(k);
+	}
+	if (_compress) {
+		if (keys.size())
+			return _log.fail(EINVAL, "Indexes from sql.index option can not be built on compressed data column");
+		for (auto & m : tll::util::list_wrap(_scheme->messages)) {
+			if (m.msgid && scheme::options_map(m.options).get("key"))
+				return _log.fail(EINVAL, "Unique key of message {} can not be built on compressed data column", m.name);
+		}
+	}
+	if (keys.size() && sqlite3_libversion_number() < 3031000)
+		return _log.fail(ENOTSUP, "Generated columns for sql.index are not supported by sqlite {}", sqlite3_libversion());
+
+	if (_columns.size()) {
+		_log.debug("Table '{}' exists", _table);
+		_name_column = _columns.count("name");
+		if (!_columns.count("msgid")) {
+			if (_migrate_msgid())
+				return EINVAL;
+			_columns.emplace("msgid");
+		}
+
+		for (auto & k : keys) {
+			auto column = _generated_column(k);
+			if (_columns.count(column))
+				continue;
+			// ALTER TABLE can add only virtual generated columns
+			if (_generated == Generated::Stored)
+				_log.warning("Stored column can not be added to existing table, create virtual column for '{}'", k);
+			_log.info("Add generated column '{}' to table '{}'", column, _table);
+			auto str = fmt::format("ALTER TABLE `{}` ADD COLUMN `{}` GENERATED ALWAYS AS ({}) VIRTUAL", _table, column, _json_path(k));
+			if (sqlite3_exec(_db.get(), str.c_str(), 0, 0, 0))
+				return _log.fail(EINVAL, "Failed to add column '{}': {}", column, sqlite3_errmsg(_db.get()));
+			_columns.emplace(std::move(column));
+		}
+	} else {
+		_log.info("Create table '{}'", _table);
+		_name_column = false;
+
+		std::string generated;
+		std::string_view storage = _generated == Generated::Stored ? "STORED" : "VIRTUAL";
+		for (auto & k : keys)
+			generated += fmt::format(", `{}` GENERATED ALWAYS AS ({}) {}", _generated_column(k), _json_path(k), storage);
+
+		query_ptr_t sql;
+		std::string_view type = _format == Format::Jsonb || _compress ? "BLOB" : "TEXT";
+		sql.reset(_prepare(fmt::format("CREATE TABLE `{}` (`seq` INTEGER, `msgid` INTEGER NOT NULL, `data` {}{})", _table, type, generated)));
+		if (!sql)
+			return _log.fail(EINVAL, "Failed to prepare CREATE statement");
+
+		if (sqlite3_step(sql.get()) != SQLITE_DONE)
+			return _log.fail(EINVAL, "Failed to create table '{}'", _table);
+
+		_columns = { "seq", "msgid", "data" };
+		for (auto & k : keys)
+			_columns.emplace(_generated_column(k));
+
+		for (auto & m : tll::util::list_wrap(_scheme->messages)) {
+			auto key = scheme::options_map(m.options).get("key");
+			if (!key || !m.msgid) continue;
+			_create_index(m.name, *key);
+		}
+	}
+
+	for (auto & m : tll::util::list_wrap(_scheme->messages)) {
+		if (!m.msgid) continue;
+		for (auto & k : _index_keys(m)) {
+			_log.debug("Create secondary index for {}: key {}", m.name, k);
+			auto str = fmt::format("CREATE INDEX IF NOT EXISTS `json_{}_{}_{}` ON `{}`(`{}`) WHERE `msgid`={}", _table, m.name, k, _table, _generated_column(k), m.msgid);
+			if (_index_create(str))
+				return _log.fail(EINVAL, "Failed to create index for '{}': {}", m.name, k);
+		}
 	}
 
 	return 0;
@@ -229,14 +592,13 @@ int JSQLite::_create_table()
 int JSQLite::_create_index(const std::string_view &name, const std::string_view &key)
 {
 	_log.debug("Create index for {}: key {}", name, key);
-	query_ptr_t sql;
-
-	auto str = fmt::format("CREATE UNIQUE INDEX `json_{}_{}` on `{}`(json_extract(data, \"$.{}\")) WHERE `name`='{}'", _table, name, _table, key, name);
-	sql.reset(_prepare(str));
-	if (!sql)
-		return _log.fail(EINVAL, "Failed to prepare index statement");
 
-	if (sqlite3_step(sql.get()) != SQLITE_DONE)
+	auto msg = json()->lookup(name);
+	if (!msg)
+		return _log.fail(ENOENT, "Message {} not found", name);
+	auto str = _key_index(*msg, key);
+	// Without replace parameter keys are expected to be unique and index is deferred in bulk load mode
+	if (_index_create(str, _replace))
 		return _log.fail(EINVAL, "Failed to create index for '{}': {}", name, key);
 	return 0;
 }
@@ -250,6 +612,11 @@ int JSQLite::_close()
 
 int JSQLite::_post(const tll_msg_t *msg, int flags)
 {
+	if (msg->type == TLL_MESSAGE_CONTROL) {
+		if (auto r = _post_control(msg); r != ENOENT)
+			return r;
+		return EINVAL;
+	}
 	if (msg->type != TLL_MESSAGE_DATA)
 		return 0;
 	if (!_insert)
@@ -264,21 +631,25 @@ int JSQLite::_post(const tll_msg_t *msg, int flags)
 		tll_channel_log_msg(self(), _log.name(), logger::Warning, tll::channel::log_msg_format::Scheme, msg, "Failed message", strlen("Failed message"));
 		return state_fail(EINVAL, "Failed to encode JSON data");
 	}
-	
-	if (!_bulk_counter) {
-		sqlite3_exec(_db.get(), "BEGIN", 0, 0, 0);
-	}
+
+	if (auto r = _begin(); r)
+		return r;
 	sqlite3_reset(_insert.get());
-	sqlite3_bind_int64(_insert.get(), 1, (sqlite3_int64) msg->seq);
-	sqlite3_bind_text(_insert.get(), 2, message->name, -1, SQLITE_STATIC);
-	sqlite3_bind_text(_insert.get(), 3, (const char *) jdata->data, jdata->size, SQLITE_STATIC);
-	auto r = sqlite3_step(_insert.get());
+	int idx = 1;
+	sqlite3_bind_int64(_insert.get(), idx++, (sqlite3_int64) msg->seq);
+	if (_name_column)
+		sqlite3_bind_text(_insert.get(), idx++, message->name, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(_insert.get(), idx++, msg->msgid);
+	if (_compress) {
+		if (_compress->compress(std::string_view((const char *) jdata->data, jdata->size), _compress_buf))
+			return state_fail(EINVAL, "Failed to compress data");
+		sqlite3_bind_blob(_insert.get(), idx++, _compress_buf.data(), _compress_buf.size(), SQLITE_STATIC);
+	} else
+		sqlite3_bind_text(_insert.get(), idx++, (const char *) jdata->data, jdata->size, SQLITE_STATIC);
+	auto r = _step(_insert.get(), 1, msg->size);
 	if (r != SQLITE_DONE)
 		return _log.fail(EINVAL, "Failed to insert data");
-	if (++_bulk_counter >= _bulk_size) {
-		_commit();
-	}
-	return 0;
+	return _bulk_update(msg->size);
 }
 
 int JSQLite::_process(long timeout, int flags)
@@ -301,15 +672,27 @@ int JSQLite::_process(long timeout, int flags)
 	tll_msg_t jmsg = {};
 	jmsg.seq = sqlite3_column_int64(_select.get(), 0);
 
-	auto nsize = sqlite3_column_bytes(_select.get(), 1);
-	if (!nsize)
-		return _log.fail(EINVAL, "NULL name for message (seq {})", jmsg.seq);
-	std::string_view name((const char *) sqlite3_column_text(_select.get(), 1), nsize);
-
-	auto message = json()->lookup(name);
-	if (!message)
-		return _log.fail(EINVAL, "Unknown message {}", name);
+	const tll::scheme::Message * message = nullptr;
+	if (_msgid_column) {
+		if (sqlite3_column_type(_select.get(), 1) == SQLITE_NULL)
+			return _log.fail(EINVAL, "NULL msgid for message (seq {})", jmsg.seq);
+		auto msgid = sqlite3_column_int64(_select.get(), 1);
+		message = json()->lookup((int) msgid);
+		if (!message)
+			return _log.fail(EINVAL, "Unknown message {}", msgid);
+	} else {
+		auto nsize = sqlite3_column_bytes(_select.get(), 1);
+		if (!nsize)
+			return _log.fail(EINVAL, "NULL name for message (seq {})", jmsg.seq);
+		std::string_view name((const char *) sqlite3_column_text(_select.get(), 1), nsize);
+
+		message = json()->lookup(name);
+		if (!message)
+			return _log.fail(EINVAL, "Unknown message {}", name);
+	}
 
+	// Text rows are left from table filled before compression was enabled
+	const bool compressed = _compress && sqlite3_column_type(_select.get(), 2) == SQLITE_BLOB;
 	auto size = sqlite3_column_bytes(_select.get(), 2);
 	if (size == 0) {
 		_callback_data(&jmsg);
@@ -318,6 +701,20 @@ int JSQLite::_process(long timeout, int flags)
 	jmsg.size = size;
 	jmsg.data = sqlite3_column_blob(_select.get(), 2);
 
+	if (compressed) {
+		std::string_view z((const char *) jmsg.data, jmsg.size);
+		auto full = _compress->size(z);
+		if (full < 0)
+			return _log.fail(EINVAL, "Invalid compressed data for message {} (seq {})", message->name, jmsg.seq);
+		// Keep data null terminated like text returned by sqlite
+		_compress_buf.resize(full + 1);
+		_compress_buf[full] = 0;
+		if (_compress->decompress(z, _compress_buf.data(), full))
+			return _log.fail(EINVAL, "Failed to decompress data for message {} (seq {})", message->name, jmsg.seq);
+		jmsg.size = full;
+		jmsg.data = _compress_buf.data();
+	}
+
 	auto data = json()->decode(message, jmsg, &jmsg);
 	if (!data)
 		return _log.fail(EINVAL, "Failed to decode JSON for message {} (seq {})", message->name, jmsg.seq);
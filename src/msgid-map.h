@@ -0,0 +1,102 @@
+#ifndef _MSGID_MAP_H
+#define _MSGID_MAP_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/**
+ * Lookup table from message id to value, filled once when channel is opened.
+ *
+ * Values are stored contiguously in insertion order. Small non-negative ids are resolved
+ * through dense index, other ids through open addressing hash table with linear probing.
+ */
+template <typename T>
+class MsgidMap
+{
+	static constexpr int dense_limit = 4096;
+
+	std::vector<T> _values;
+	std::vector<unsigned> _dense; ///< Index + 1 in _values, 0 for missing id
+	std::vector<std::pair<int, unsigned>> _sparse; ///< Pairs of id and index + 1
+	size_t _sparse_size = 0;
+
+	static size_t _hash(int id) { return (unsigned) id * 2654435761u; }
+
+	void _sparse_insert(int id, unsigned index)
+	{
+		const auto mask = _sparse.size() - 1;
+		for (auto i = _hash(id) & mask; ; i = (i + 1) & mask) {
+			if (_sparse[i].second == 0) {
+				_sparse[i] = { id, index };
+				return;
+			}
+		}
+	}
+
+	void _sparse_rehash()
+	{
+		auto old = std::move(_sparse);
+		_sparse.clear();
+		_sparse.resize(old.size() ? old.size() * 2 : 16);
+		for (auto & [id, index] : old) {
+			if (index)
+				_sparse_insert(id, index);
+		}
+	}
+
+ public:
+	using iterator = typename std::vector<T>::iterator;
+
+	iterator begin() { return _values.begin(); }
+	iterator end() { return _values.end(); }
+
+	size_t size() const { return _values.size(); }
+
+	void clear()
+	{
+		_values.clear();
+		_dense.clear();
+		_sparse.clear();
+		_sparse_size = 0;
+	}
+
+	T * find(int id)
+	{
+		if (id >= 0 && id < dense_limit) {
+			if ((size_t) id >= _dense.size() || !_dense[id])
+				return nullptr;
+			return &_values[_dense[id] - 1];
+		}
+		if (!_sparse_size)
+			return nullptr;
+		const auto mask = _sparse.size() - 1;
+		for (auto i = _hash(id) & mask; _sparse[i].second; i = (i + 1) & mask) {
+			if (_sparse[i].first == id)
+				return &_values[_sparse[i].second - 1];
+		}
+		return nullptr;
+	}
+
+	/// Add new value, return nullptr if id is already present. Pointers to values are invalidated.
+	T * emplace(int id, T && value)
+	{
+		if (find(id))
+			return nullptr;
+		_values.push_back(std::move(value));
+		const unsigned index = _values.size();
+		if (id >= 0 && id < dense_limit) {
+			if ((size_t) id >= _dense.size())
+				_dense.resize(id + 1);
+			_dense[id] = index;
+		} else {
+			if (2 * (_sparse_size + 1) > _sparse.size())
+				_sparse_rehash();
+			_sparse_insert(id, index);
+			_sparse_size++;
+		}
+		return &_values.back();
+	}
+};
+
+#endif//_MSGID_MAP_H
@@ -0,0 +1,89 @@
+#ifndef _RING_H
+#define _RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/**
+ * Single producer, single consumer ring buffer with variable size records.
+ *
+ * Each record is prefixed with its size and aligned to 8 bytes. Record that does not fit into
+ * the tail of the buffer is placed at the beginning, skipped space is marked with padding header.
+ * Maximum record size is half of the buffer.
+ */
+class SPSCRing
+{
+	static constexpr size_t npos = (size_t) -1;
+	static constexpr size_t align(size_t size) { return (size + 7) & ~(size_t) 7; }
+
+	std::vector<char> _data;
+
+	alignas(64) std::atomic<size_t> _head = 0; ///< Consumer position
+	size_t _head_next = 0;
+
+	alignas(64) std::atomic<size_t> _tail = 0; ///< Producer position
+	size_t _tail_next = 0;
+
+ public:
+	void resize(size_t size)
+	{
+		_data.resize(align(size));
+		_head = _head_next = 0;
+		_tail = _tail_next = 0;
+	}
+
+	size_t capacity() const { return _data.size(); }
+	size_t max_record() const { return (_data.size() / 2 & ~(size_t) 7) - sizeof(size_t); }
+
+	bool empty() const { return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire); }
+
+	/// Reserve space for record, return nullptr if there is not enough free space
+	void * write_begin(size_t size)
+	{
+		const auto full = align(sizeof(size_t) + size);
+		if (full > (_data.size() / 2 & ~(size_t) 7))
+			return nullptr;
+		auto tail = _tail.load(std::memory_order_relaxed);
+		auto head = _head.load(std::memory_order_acquire);
+		auto off = tail % _data.size();
+		size_t pad = 0;
+		if (_data.size() - off < full)
+			pad = _data.size() - off;
+		if (tail + pad + full - head > _data.size())
+			return nullptr;
+		if (pad) {
+			*(size_t *) (_data.data() + off) = npos;
+			off = 0;
+		}
+		*(size_t *) (_data.data() + off) = size;
+		_tail_next = tail + pad + full;
+		return _data.data() + off + sizeof(size_t);
+	}
+
+	/// Publish record reserved with write_begin
+	void write_end() { _tail.store(_tail_next, std::memory_order_release); }
+
+	/// Get first record, return nullptr if ring is empty
+	const void * read(size_t * size)
+	{
+		auto head = _head.load(std::memory_order_relaxed);
+		if (head == _tail.load(std::memory_order_acquire))
+			return nullptr;
+		auto off = head % _data.size();
+		auto s = *(const size_t *) (_data.data() + off);
+		if (s == npos) {
+			head += _data.size() - off;
+			off = 0;
+			s = *(const size_t *) _data.data();
+		}
+		_head_next = head + align(sizeof(size_t) + s);
+		*size = s;
+		return _data.data() + off + sizeof(size_t);
+	}
+
+	/// Release record returned by read
+	void shift() { _head.store(_head_next, std::memory_order_release); }
+};
+
+#endif//_RING_H
@@ -15,6 +15,26 @@ static constexpr std::string_view scheme = R"(yamls://
   id: 2
   fields:
     - {name: msgid, type: int64}
+    - {name: seq, type: int64}
+    - {name: seq_end, type: int64}
+    - {name: limit, type: int64}
+
+- name: Commit
+  id: 3
+
+- name: LastSeqQuery
+  id: 4
+  fields:
+    - {name: msgid, type: int64}
+
+- name: LastSeq
+  id: 5
+  fields:
+    - {name: msgid, type: int64}
+    - {name: seq, type: int64}
+
+- name: BuildIndex
+  id: 6
 )";
 
 struct EndOfData {
@@ -24,6 +44,28 @@ struct EndOfData {
 struct TableName {
 	static constexpr int id = 2;
 	int64_t msgid;
+	int64_t seq; ///< First seq to read, 0 - from the beginning
+	int64_t seq_end; ///< Last seq to read, 0 - no limit
+	int64_t limit; ///< Maximum number of rows, 0 - no limit
+};
+
+struct Commit {
+	static constexpr int id = 3;
+};
+
+struct LastSeqQuery {
+	static constexpr int id = 4;
+	int64_t msgid;
+};
+
+struct LastSeq {
+	static constexpr int id = 5;
+	int64_t msgid;
+	int64_t seq; ///< Last seq in the table, -1 if table is empty
+};
+
+struct BuildIndex {
+	static constexpr int id = 6;
 };
 
 }
@@ -5,6 +5,7 @@ import pytest
 import os
 
 from tll.channel import Context
+from tll.error import TLLError
 from tll.test_util import *
 
 SCHEME = '''yamls://
@@ -44,9 +45,20 @@ data = [{'header':{'s0':10, 's1':'first'}, 'f0': 1, 'f1': 10.1}
     ({'query.header.s1':'second'}, [1]),
     ({'query': 'msg', 'query.f0':'1'}, [1,2]),
     ({'query': 'msg', 'query.header.s0':'10'}, [1]),
+    ({'query': 'msg', 'query.f1:gt':'12'}, [2]),
+    ({'query': 'msg', 'query.f1:le':'12'}, [1]),
+    ({'query': 'msg', 'query.header.s0:ne':'10'}, [2]),
+    ({'query': 'msg', 'query.header.s0:in':'10, 30'}, [1]),
+    ({'query': 'msg', 'query.f1:between':'10,21'}, [1,2]),
+    ({'query': 'msg', 'query.header.s1':'> first'}, []),
+    ({'query': 'msg', 'order-by':'seq desc'}, [2,1]),
+    ({'query': 'msg', 'order-by':'header.s1, seq'}, [2,1]),
+    ({'query': 'msg', 'limit':'1'}, [1]),
+    ({'query': 'msg', 'query.f1:ge':'10', 'order-by':'seq desc', 'limit':'1'}, [2]),
 ])
-def test(context, db_file, query, check):
-    c = Accum(f'jsqlite://{db_file};dir=rw', scheme=SCHEME, table='test', context=context, name='master')
+@pytest.mark.parametrize("format", ['text', 'jsonb'])
+def test(context, db_file, query, check, format):
+    c = Accum(f'jsqlite://{db_file};dir=rw;format={format}', scheme=SCHEME, table='test', context=context, name='master')
     #c = Accum('jsqlite://:memory:;dir=rw', scheme=SCHEME, table='test')
     c.open()
     for s,d in enumerate(data):
@@ -54,7 +66,7 @@ def test(context, db_file, query, check):
 
     c.close()
 
-    ci = Accum(f'jsqlite://{db_file};dir=r', scheme=SCHEME, table='test', dump='scheme', autoclose='yes', name='client', context=context)
+    ci = Accum(f'jsqlite://{db_file};dir=r;format={format}', scheme=SCHEME, table='test', dump='scheme', autoclose='yes', name='client', context=context)
     ci.open(**query)
     scheme = ci.scheme
     for _ in range(10):
@@ -63,3 +75,172 @@ def test(context, db_file, query, check):
     for m,c in zip([x for x in ci.result if x.type == x.Type.Data], check):
         r = scheme.unpack(m)
         assert r.as_dict() == data[c]
+
+UNSIGNED = '''yamls://
+- name: msg
+  id: 10
+  fields:
+    - {name: u8, type: uint8}
+    - {name: u32, type: uint32}
+'''
+
+@pytest.mark.parametrize("query,check", [
+    ({'query.u8:gt': '100'}, [200]),
+    ({'query.u32:lt': '2000'}, [10]),
+    ({'query.u8:between': '5, 150'}, [10]),
+])
+def test_query_unsigned(context, db_file, query, check):
+    c = Accum(f'jsqlite://{db_file};dir=w', scheme=UNSIGNED, table='test', context=context, name='master')
+    c.open()
+    for s, v in enumerate([10, 200]):
+        c.post({'u8': v, 'u32': v * 100}, name='msg', seq=s)
+    c.close()
+
+    ci = Accum(f'jsqlite://{db_file};dir=r', scheme=UNSIGNED, table='test', autoclose='yes', name='client', context=context)
+    ci.open(query='msg', **query)
+    for _ in range(5):
+        ci.process()
+    assert [ci.scheme.unpack(m).u8 for m in ci.result if m.type == m.Type.Data] == check
+
+@pytest.mark.parametrize("query", [
+    {'order-by': 'f0"),("x'},
+    {'query': 'msg', 'order-by': 'header.missing'},
+    {'query': 'msg', 'query.f0:like': '1'},
+])
+def test_query_invalid(context, db_file, query):
+    c = Accum(f'jsqlite://{db_file};dir=w', scheme=SCHEME, table='test', context=context, name='master')
+    c.open()
+    c.close()
+
+    ci = Accum(f'jsqlite://{db_file};dir=r', scheme=SCHEME, table='test', name='client', context=context)
+    with pytest.raises(TLLError):
+        ci.open(**query)
+
+def test_msgid_migrate(context, db_file):
+    import json
+    import sqlite3
+
+    db = sqlite3.connect(db_file)
+    db.execute('CREATE TABLE `test` (`seq` INTEGER, `name` VARCHAR NOT NULL, `data` TEXT)')
+    db.execute('CREATE UNIQUE INDEX `json_test_msg` on `test`(json_extract(data, "$.header.s0")) WHERE `name`=\'msg\'')
+    db.executemany('INSERT INTO `test` VALUES (?, ?, ?)', [(s, 'msg', json.dumps(d)) for s, d in enumerate([data[0], data[2]])])
+    db.commit()
+
+    ci = Accum(f'jsqlite://{db_file};dir=r', scheme=SCHEME, table='test', autoclose='yes', name='legacy', context=context)
+    ci.open(query='msg')
+    for _ in range(5):
+        ci.process()
+    assert [(m.msgid, m.seq) for m in ci.result if m.type == m.Type.Data] == [(10, 0), (10, 1)]
+
+    c = Accum(f'jsqlite://{db_file};dir=w', scheme=SCHEME, table='test', context=context, name='master')
+    c.open()
+    assert [r[1] for r in db.execute('PRAGMA table_info(`test`)')] == ['seq', 'name', 'data', 'msgid']
+    assert list(db.execute('SELECT `seq`, `msgid` FROM `test`')) == [(0, 10), (1, 10)]
+    assert list(db.execute("SELECT sql FROM sqlite_master WHERE name = 'json_test_msg'"))[0][0].endswith('WHERE `msgid`=10')
+    plan = ' '.join(r[-1] for r in db.execute('EXPLAIN QUERY PLAN SELECT seq FROM `test` WHERE `msgid` = 10 AND json_extract(data, "$.header.s0") = ?', (10,)))
+    assert 'json_test_msg' in plan
+
+    # Same key, row with seq 0 is replaced using recreated index
+    c.post(data[1], name='msg', seq=2)
+    c.close()
+    assert list(db.execute('SELECT `seq`, `name`, `msgid` FROM `test` WHERE `seq` = 2')) == [(2, 'msg', 10)]
+
+    ci = Accum(f'jsqlite://{db_file};dir=r', scheme=SCHEME, table='test', autoclose='yes', name='client', context=context)
+    ci.open(query='msg')
+    for _ in range(5):
+        ci.process()
+    assert [ci.scheme.unpack(m).as_dict() for m in ci.result if m.type == m.Type.Data] == [data[2], data[1]]
+
+def test_msgid_column(context, db_file):
+    import sqlite3
+
+    c = Accum(f'jsqlite://{db_file};dir=w', scheme=SCHEME, table='test', context=context, name='master')
+    c.open()
+    c.post(data[0], name='msg', seq=0)
+    c.close()
+
+    db = sqlite3.connect(db_file)
+    assert [r[1] for r in db.execute('PRAGMA table_info(`test`)')] == ['seq', 'msgid', 'data']
+    assert list(db.execute('SELECT `seq`, `msgid` FROM `test`')) == [(0, 10)]
+
+@pytest.mark.parametrize("generated", ['virtual', 'stored'])
+def test_sql_index(context, db_file, generated):
+    import sqlite3
+
+    scheme = SCHEME.replace("  options.key: header.s0\n", "  options.key: header.s0\n  options.sql.index: 'header.s1, f1'\n")
+    c = Accum(f'jsqlite://{db_file};dir=w;generated-column={generated}', scheme=scheme, table='test', context=context, name='master')
+    c.open()
+    for s,d in enumerate(data):
+        c.post(d, name='msg', seq=s)
+    c.close()
+
+    db = sqlite3.connect(db_file)
+    assert [r[1] for r in db.execute('PRAGMA table_xinfo(`test`)')] == ['seq', 'msgid', 'data', '$.f1', '$.header.s1']
+    indexes = [r[0] for r in db.execute("SELECT name FROM sqlite_master WHERE type='index' AND tbl_name='test'")]
+    assert sorted(indexes) == ['json_test_msg', 'json_test_msg_f1', 'json_test_msg_header.s1']
+    plan = ' '.join(r[-1] for r in db.execute('EXPLAIN QUERY PLAN SELECT seq FROM `test` WHERE `msgid` = 10 AND `$.header.s1` = ?', ('first',)))
+    assert 'json_test_msg_header.s1' in plan
+
+    ci = Accum(f'jsqlite://{db_file};dir=r', scheme=scheme, table='test', autoclose='yes', name='client', context=context)
+    ci.open(**{'query': 'msg', 'query.header.s1': 'first'})
+    for _ in range(5):
+        ci.process()
+    assert [ci.scheme.unpack(m).as_dict() for m in ci.result if m.type == m.Type.Data] == [data[0], data[2]]
+
+def test_pool(context, db_file):
+    c = Accum(f'jsqlite://{db_file};dir=w', scheme=SCHEME, table='test', context=context, name='master')
+    c.open()
+    for s,d in enumerate(data):
+        c.post(d, name='msg', seq=s)
+
+    with pytest.raises(TLLError):
+        Accum('jsqlite://;dir=w;pool=yes', master=c, context=context, name='writer')
+
+    children = [Accum('jsqlite://;dir=r;pool=yes;autoclose=yes', master=c, context=context, name=f'pool-{i}') for i in range(2)]
+    for ci in children:
+        ci.open(query='msg', **{'order-by': 'seq'})
+    for _ in range(5):
+        for ci in children:
+            ci.process()
+
+    for ci in children:
+        assert ci.state == ci.State.Closed
+        assert [ci.scheme.unpack(m).as_dict() for m in ci.result if m.type == m.Type.Data] == data[1:]
+
+    c.post(data[0], name='msg', seq=10)
+    children[0].open()
+    for _ in range(5):
+        children[0].process()
+    assert [m.seq for m in children[0].result if m.type == m.Type.Data][-1] == 10
+
+@pytest.mark.parametrize("codec", ['zstd', 'lz4'])
+def test_compress(context, db_file, codec):
+    import sqlite3
+
+    try:
+        context.Channel(f'jsqlite://:memory:;table=probe;compress={codec}', name='probe')
+    except TLLError:
+        pytest.skip(f'{codec} compression is not enabled in this build')
+
+    scheme = SCHEME.replace("  options.key: header.s0\n", "")
+    c = Accum(f'jsqlite://{db_file};dir=w;compress={codec}', scheme=scheme, table='test', context=context, name='master')
+    c.open()
+    for s,d in enumerate(data):
+        c.post(d, name='msg', seq=s)
+    c.close()
+
+    db = sqlite3.connect(db_file)
+    assert [r[0] for r in db.execute('SELECT typeof(`data`) FROM `test`')] == ['blob'] * 3
+
+    ci = Accum(f'jsqlite://{db_file};dir=r;compress={codec}', scheme=scheme, table='test', autoclose='yes', name='client', context=context)
+    ci.open(query='msg', **{'order-by': 'seq desc'})
+    for _ in range(5):
+        ci.process()
+    assert [ci.scheme.unpack(m).as_dict() for m in ci.result if m.type == m.Type.Data] == data[::-1]
+
+    ci = Accum(f'jsqlite://{db_file};dir=r;compress={codec}', scheme=scheme, table='test', name='query', context=context)
+    with pytest.raises(TLLError):
+        ci.open(**{'query': 'msg', 'query.f0': '1'})
+
+    with pytest.raises(TLLError):
+        Accum(f'jsqlite://{db_file};dir=w;compress={codec};format=jsonb', scheme=scheme, table='test', context=context, name='jsonb')
@@ -3,6 +3,7 @@
 
 import os
 import sqlite3
+import time
 
 import pytest
 
@@ -148,6 +149,214 @@ def test_bulk(context, db_file):
 
     assert list(db.cursor().execute('SELECT * FROM `msg`')) == [(i, i) for i in range(15)]
 
+def test_bulk_bytes(context, db_file):
+    db = sqlite3.connect(db_file)
+    c = context.Channel(f'sqlite://{db_file};replace=false;bulk-size=1000;bulk-bytes=16', scheme=BULK, dump='scheme')
+    c.open()
+
+    for i in range(3):
+        c.post(name='msg', data={'field': i}, seq=i)
+
+    assert list(db.cursor().execute('SELECT * FROM `msg`')) == []
+
+    c.post(name='msg', data={'field': 3}, seq=3)
+
+    assert list(db.cursor().execute('SELECT * FROM `msg`')) == [(i, i) for i in range(4)]
+
+def test_bulk_unlimited(context, db_file):
+    db = sqlite3.connect(db_file)
+    c = context.Channel(f'sqlite://{db_file};bulk-bytes=16', scheme=BULK, dump='scheme')
+    c.open()
+
+    # Zero bulk size is not a limit when bulk-bytes is set
+    for i in range(3):
+        c.post(name='msg', data={'field': i}, seq=i)
+
+    assert list(db.cursor().execute('SELECT * FROM `msg`')) == []
+
+    c.post(name='msg', data={'field': 3}, seq=3)
+
+    assert list(db.cursor().execute('SELECT * FROM `msg`')) == [(i, i) for i in range(4)]
+
+def test_bulk_commit(context, db_file):
+    db = sqlite3.connect(db_file)
+    c = context.Channel(f'sqlite://{db_file};replace=false;bulk-size=1000', scheme=BULK, dump='scheme')
+    c.open()
+
+    for i in range(5):
+        c.post(name='msg', data={'field': i}, seq=i)
+
+    assert list(db.cursor().execute('SELECT * FROM `msg`')) == []
+
+    c.post({}, name='Commit', type=c.Type.Control)
+
+    assert list(db.cursor().execute('SELECT * FROM `msg`')) == [(i, i) for i in range(5)]
+
+    c.post({}, name='Commit', type=c.Type.Control)
+
+def test_bulk_interval(context, db_file):
+    db = sqlite3.connect(db_file)
+    c = Accum(f'sqlite://{db_file};replace=false;bulk-size=1000;bulk-interval=10ms', scheme=BULK, name='writer', context=context)
+    c.open()
+
+    for i in range(5):
+        c.post(name='msg', data={'field': i}, seq=i)
+
+    assert list(db.cursor().execute('SELECT * FROM `msg`')) == []
+
+    timer = [x for x in c.children if x.name == 'writer/bulk-timer'][0]
+    assert timer.state == timer.State.Active
+    time.sleep(0.02)
+    timer.process()
+
+    assert list(db.cursor().execute('SELECT * FROM `msg`')) == [(i, i) for i in range(5)]
+
+
+def test_bulk_interval_rearm(context, db_file):
+    db = sqlite3.connect(db_file)
+    c = Accum(f'sqlite://{db_file};bulk-interval=100ms', scheme=BULK, name='writer', context=context)
+    c.open()
+    timer = [x for x in c.children if x.name == 'writer/bulk-timer'][0]
+
+    c.post(name='msg', data={'field': 0}, seq=0)
+    time.sleep(0.06)
+    c.post({}, name='Commit', type=c.Type.Control)
+    assert list(db.cursor().execute('SELECT COUNT(*) FROM `msg`')) == [(1,)]
+
+    # Commit restarts timer, interval is counted from it
+    c.post(name='msg', data={'field': 1}, seq=1)
+    time.sleep(0.06)
+    timer.process()
+    assert list(db.cursor().execute('SELECT COUNT(*) FROM `msg`')) == [(1,)]
+
+    time.sleep(0.06)
+    timer.process()
+    assert list(db.cursor().execute('SELECT COUNT(*) FROM `msg`')) == [(2,)]
+
+def test_bulk_interval_async(context, db_file):
+    db = sqlite3.connect(db_file)
+    c = context.Channel(f'sqlite://{db_file};async=yes;bulk-interval=10ms', scheme=BULK, name='writer')
+    c.open()
+
+    for i in range(5):
+        c.post(name='msg', data={'field': i}, seq=i)
+
+    for _ in range(100):
+        time.sleep(0.005)
+        if list(db.cursor().execute('SELECT COUNT(*) FROM `msg`')) == [(5,)]:
+            break
+    assert list(db.cursor().execute('SELECT * FROM `msg`')) == [(i, i) for i in range(5)]
+    c.close()
+
+def test_bulk_rows(context, db_file):
+    db = sqlite3.connect(db_file)
+    c = context.Channel(f'sqlite://{db_file};replace=false;bulk-size=10;rows-per-statement=4', scheme=BULK, dump='scheme')
+    c.open()
+
+    for i in range(5):
+        c.post(name='msg', data={'field': i}, seq=i)
+
+    assert list(db.cursor().execute('SELECT * FROM `msg`')) == []
+
+    for i in range(5, 10):
+        c.post(name='msg', data={'field': i}, seq=i)
+
+    assert list(db.cursor().execute('SELECT * FROM `msg`')) == [(i, i) for i in range(10)]
+
+    for i in range(10, 15):
+        c.post(name='msg', data={'field': i}, seq=i)
+
+    c.close()
+
+    assert list(db.cursor().execute('SELECT * FROM `msg`')) == [(i, i) for i in range(15)]
+
+def test_stat(context, db_file):
+    c = Accum(f'sqlite://{db_file};stat=yes;bulk-size=2', scheme=BULK, name='writer', context=context)
+    c.open()
+    for i in range(5):
+        c.post(name='msg', data={'field': i}, seq=i)
+    c.post({}, name='Commit', type=c.Type.Control)
+
+    stat = {f.name: f.value for f in c.stat.swap()}
+    assert stat['rows'] == 5
+    assert stat['bind'] == 5 * 4
+    assert stat['busy'] == 0
+    c.close()
+
+    c.open(table='msg')
+    for _ in range(10):
+        c.process()
+    assert [x.seq for x in c.result if x.type == x.Type.Data] == list(range(5))
+    stat = {f.name: f.value for f in c.stat.swap()}
+    assert stat['rx'] == 5
+
+def test_async(context, db_file):
+    db = sqlite3.connect(db_file)
+    c = context.Channel(f'sqlite://{db_file};replace=false;bulk-size=100;async=yes;async-size=4kb', scheme=BULK, dump='scheme')
+    c.open()
+
+    for i in range(1000):
+        c.post(name='msg', data={'field': i}, seq=i)
+
+    c.post({}, name='Commit', type=c.Type.Control)
+    c.close()
+
+    assert list(db.cursor().execute('SELECT * FROM `msg`')) == [(i, i) for i in range(1000)]
+
+def test_async_eagain(context, db_file):
+    c = context.Channel(f'sqlite://{db_file};replace=false;async=yes;async-size=1kb;async-full=eagain', scheme=BULK, dump='scheme')
+    c.open()
+
+    with pytest.raises(TLLError):
+        c.post({}, name='TableName', type=c.Type.Control)
+
+    with pytest.raises(TLLError):
+        for i in range(100000):
+            c.post(name='msg', data={'field': i}, seq=i)
+
+    c.close()
+
+def test_async_size(context, db_file):
+    with pytest.raises(TLLError):
+        context.Channel(f'sqlite://{db_file};async=yes;async-size=16', scheme=BULK)
+
+def test_pragma(context, db_file):
+    c = context.Channel(f'sqlite://{db_file};profile=fast-ingest;page-size=8kb;synchronous=off;wal-autocheckpoint=0', scheme=BULK, dump='scheme')
+    c.open()
+
+    c.post(name='msg', data={'field': 0}, seq=0)
+
+    db = sqlite3.connect(db_file)
+    assert list(db.cursor().execute('PRAGMA page_size')) == [(8192,)]
+    assert list(db.cursor().execute('SELECT * FROM `msg`')) == [(0, 0)]
+
+    with pytest.raises(TLLError):
+        context.Channel(f'sqlite://{db_file};synchronous=invalid', scheme=BULK)
+
+def test_checkpoint(context, db_file):
+    c = context.Channel(f'sqlite://{db_file};checkpoint=truncate;checkpoint-interval=10ms', scheme=BULK, dump='scheme')
+    c.open()
+
+    for i in range(10):
+        c.post(name='msg', data={'field': i}, seq=i)
+
+    assert os.path.getsize(db_file + '-wal') > 0
+
+    for _ in range(100):
+        time.sleep(0.01)
+        if os.path.getsize(db_file + '-wal') == 0:
+            break
+    assert os.path.getsize(db_file + '-wal') == 0
+
+    c.close()
+
+    with pytest.raises(TLLError):
+        context.Channel(f'sqlite://{db_file};checkpoint=passive;journal=default', scheme=BULK)
+
+    for url in ('locking-mode=exclusive', 'bulk-load=yes'):
+        with pytest.raises(TLLError):
+            context.Channel(f'sqlite://{db_file};checkpoint=passive;{url}', scheme=BULK)
+
 REMAP = '''yamls://
 - name: msg
   options.sql.table: table
@@ -181,6 +390,132 @@ def test_query(context, db_file):
         assert [(x.msgid, x.seq, c.unpack(x).as_dict()) for x in c.result] ==\
             [(10, j, {"field": j + 1}) for j in range(i + 1)]
 
+def test_query_batch(context, db_file):
+    c = Accum(f'sqlite://{db_file};replace=false;batch=3', scheme=BULK, dump='scheme', context=context)
+    c.open()
+
+    for i in range(5):
+        c.post(name='msg', data={'field': i + 1}, seq=i)
+
+    c.close()
+    c.open(table='msg')
+
+    c.process()
+    assert [(x.msgid, x.seq) for x in c.result] == [(10, j) for j in range(3)]
+
+    c.process()
+    assert [(x.msgid, x.seq, c.unpack(x).as_dict()) for x in c.result] == [(10, j, {"field": j + 1}) for j in range(5)]
+
+    c.process()
+    assert c.result[-1].msgid == c.scheme_control['EndOfData'].msgid
+    assert c.result[-1].type == c.result[-1].Type.Control
+    assert len(c.result) == 6
+
+@pytest.mark.parametrize("query,check", [
+    ({}, list(range(10))),
+    ({'seq': '3'}, list(range(3, 10))),
+    ({'seq': '3', 'seq-end': '6'}, list(range(3, 7))),
+    ({'seq-end': '2'}, list(range(3))),
+    ({'seq': '5', 'limit': '2'}, [5, 6]),
+])
+def test_query_range(context, db_file, query, check):
+    c = Accum(f'sqlite://{db_file};replace=false;batch=100', scheme=BULK, dump='scheme', context=context)
+    c.open()
+
+    for i in range(10):
+        c.post(name='msg', data={'field': i}, seq=i)
+
+    c.post({'msgid': 10}, name='LastSeqQuery', type=c.Type.Control)
+    assert [(x.type, x.msgid) for x in c.result] == [(c.Type.Control, c.scheme_control['LastSeq'].msgid)]
+    assert c.unpack(c.result[0]).as_dict() == {'msgid': 10, 'seq': 9}
+
+    c.close()
+    c.result = []
+    c.open(table='msg', **query)
+
+    c.process()
+    assert [x.seq for x in c.result if x.type == x.Type.Data] == check
+    assert c.result[-1].msgid == c.scheme_control['EndOfData'].msgid
+
+def test_query_no_index(context, db_file):
+    c = Accum(f'sqlite://{db_file};seq-index=no;batch=100', scheme=BULK, dump='scheme', context=context)
+    c.open()
+
+    for i in reversed(range(5)):
+        c.post(name='msg', data={'field': i}, seq=i)
+
+    c.close()
+
+    # Without seq index rows are streamed in insert order
+    c.open(table='msg')
+    c.process()
+    assert [x.seq for x in c.result if x.type == x.Type.Data] == list(reversed(range(5)))
+    assert c.result[-1].msgid == c.scheme_control['EndOfData'].msgid
+    c.close()
+
+    for query in ({'seq': '2'}, {'limit': '2'}):
+        with pytest.raises(TLLError):
+            c.open(table='msg', **query)
+        c.close()
+
+def test_follow(context, db_file):
+    w = context.Channel(f'sqlite://{db_file};replace=false', scheme=BULK, name='writer')
+    w.open()
+
+    for i in range(3):
+        w.post(name='msg', data={'field': i}, seq=i)
+
+    c = Accum(f'sqlite://{db_file};replace=false;follow=yes;follow-interval=1ms;batch=100', scheme=BULK, name='reader', context=context)
+    c.open(table='msg')
+
+    c.process()
+    assert [x.seq for x in c.result if x.type == x.Type.Data] == [0, 1, 2]
+    assert c.result[-1].msgid == c.scheme_control['EndOfData'].msgid
+
+    timer = [x for x in c.children if x.name == 'reader/follow-timer'][0]
+    time.sleep(0.01)
+    timer.process()
+    c.process()
+    assert len(c.result) == 4
+
+    for i in range(3, 5):
+        w.post(name='msg', data={'field': i}, seq=i)
+
+    time.sleep(0.01)
+    timer.process()
+    c.process()
+    assert [x.seq for x in c.result if x.type == x.Type.Data] == [0, 1, 2, 3, 4]
+    assert len(c.result) == 6
+
+def test_follow_checkpoint(context, db_file):
+    w = context.Channel(f'sqlite://{db_file};replace=false', scheme=BULK, name='writer')
+    w.open()
+
+    for i in range(3):
+        w.post(name='msg', data={'field': i}, seq=i)
+
+    c = Accum(f'sqlite://{db_file};replace=false;follow=yes;follow-interval=1ms;batch=100', scheme=BULK, name='reader', context=context)
+    c.open(table='msg')
+    c.process()
+    assert [x.seq for x in c.result if x.type == x.Type.Data] == [0, 1, 2]
+
+    timer = [x for x in c.children if x.name == 'reader/follow-timer'][0]
+    time.sleep(0.01)
+    timer.process()
+    c.process()
+
+    assert os.path.getsize(db_file + '-wal') > 0
+    # Follower keeps no read transaction between polls so WAL can be truncated
+    db = sqlite3.connect(db_file)
+    assert list(db.cursor().execute('PRAGMA wal_checkpoint(TRUNCATE)'))[0][0] == 0
+    assert os.path.getsize(db_file + '-wal') == 0
+
+    w.post(name='msg', data={'field': 3}, seq=3)
+    time.sleep(0.01)
+    timer.process()
+    c.process()
+    assert [x.seq for x in c.result if x.type == x.Type.Data] == [0, 1, 2, 3]
+
 def test_query_text(context, db_file):
     db = sqlite3.connect(db_file)
     c = Accum(f'sqlite://{db_file};replace=false', scheme=SCHEME, dump='scheme', context=context)
@@ -247,3 +582,463 @@ def test_control_message(context, db_file):
     assert c.result[-1].msgid == c.scheme_control['EndOfData'].msgid
     assert c.result[-1].type == c.result[-1].Type.Control
     assert len(c.result) == 18
+
+BLOB = '''yamls://
+- name: msg
+  id: 10
+  fields:
+    - {name: id, type: int32, options.sql.index: unique}
+    - {name: f, type: double}
+    - {name: s, type: string}
+'''
+
+@pytest.mark.parametrize("url,scheme", [('storage=blob', BLOB), ('', BLOB.replace('  id: 10\n', '  id: 10\n  options.sql.storage: blob\n'))])
+def test_storage_blob(context, db_file, url, scheme):
+    db = sqlite3.connect(db_file)
+    c = Accum(f'sqlite://{db_file};batch=100;{url}', scheme=scheme, dump='scheme', context=context)
+    c.open()
+
+    data = [{'id': i, 'f': i / 2, 's': 'x' * i} for i in range(5)]
+    for i, d in enumerate(data):
+        c.post(name='msg', data=d, seq=100 + i)
+
+    assert [x[1] for x in db.cursor().execute('PRAGMA table_info(`msg`)')] == ['_tll_seq', 'id', '_tll_data']
+    assert list(db.cursor().execute('SELECT `_tll_seq`, `id` FROM `msg`')) == [(100 + i, i) for i in range(5)]
+
+    c.close()
+    c.open(table='msg')
+    c.process()
+    result = [x for x in c.result if x.type == x.Type.Data]
+    assert [x.seq for x in result] == [100 + i for i in range(5)]
+    assert [c.unpack(x).as_dict() for x in result] == data
+    assert c.result[-1].msgid == c.scheme_control['EndOfData'].msgid
+
+SHARD = '''yamls://
+- name: msg
+  id: 10
+  fields:
+    - {name: key, type: int32, options.sql.shard-key: true}
+    - {name: field, type: int32}
+'''
+
+def test_shards(context, db_file):
+    c = Accum(f'sqlite://{db_file};shards=3;batch=100', scheme=SHARD, dump='scheme', name='sharded', context=context)
+    c.open()
+
+    for i in range(30):
+        c.post(name='msg', data={'key': i, 'field': i * 10}, seq=i)
+    c.post({}, name='Commit', type=c.Type.Control)
+    c.close()
+
+    assert not os.path.exists(db_file)
+    counts = []
+    for i in range(3):
+        db = sqlite3.connect(f'{db_file}.{i}')
+        counts.append(list(db.cursor().execute('SELECT COUNT(*) FROM `msg`'))[0][0])
+    assert sum(counts) == 30
+    assert len([x for x in counts if x]) > 1
+
+    c.open(table='msg')
+    c.process()
+    result = [x for x in c.result if x.type == x.Type.Data]
+    assert [x.seq for x in result] == list(range(30))
+    assert [c.unpack(x).field for x in result] == [i * 10 for i in range(30)]
+    assert c.result[-1].msgid == c.scheme_control['EndOfData'].msgid
+
+    c.close()
+    c.result = []
+    c.open(table='msg', seq='5', limit='3')
+    c.process()
+    assert [x.seq for x in c.result if x.type == x.Type.Data] == [5, 6, 7]
+
+    c.result = []
+    c.post({'msgid': 10, 'seq': 27}, name='TableName', type=c.Type.Control)
+    c.process()
+    assert [x.seq for x in c.result if x.type == x.Type.Data] == [27, 28, 29]
+    assert c.result[-1].msgid == c.scheme_control['EndOfData'].msgid
+
+def test_shards_error(context, db_file):
+    c = context.Channel(f'sqlite://{db_file};shards=2', scheme=SHARD, name='sharded')
+    c.open()
+
+    # Same key is routed to same shard, duplicate seq fails in async writer
+    c.post(name='msg', data={'key': 1, 'field': 0}, seq=1)
+    c.post(name='msg', data={'key': 1, 'field': 1}, seq=1)
+
+    with pytest.raises(TLLError):
+        c.close()
+
+def test_bulk_load(context, db_file):
+    c = context.Channel(f'sqlite://{db_file};bulk-load=yes;bulk-size=100;locking-mode=normal', scheme=SCHEME, dump='scheme')
+    c.open()
+
+    for i in range(10):
+        c.post(name='scalar', data={'i8': i, 'i16': i}, seq=i)
+
+    db = sqlite3.connect(db_file)
+    query = "SELECT name FROM sqlite_master WHERE type='index' AND tbl_name='scalar'"
+    assert list(db.cursor().execute(query)) == []
+
+    c.post({}, name='BuildIndex', type=c.Type.Control)
+
+    assert sorted(x[0] for x in db.cursor().execute(query)) == ['_tll_scalar__tll_seq', '_tll_scalar_i16', '_tll_scalar_i8']
+    assert list(db.cursor().execute('SELECT COUNT(*) FROM `scalar`')) == [(10,)]
+
+def test_bulk_load_close(context, db_file):
+    c = context.Channel(f'sqlite://{db_file};bulk-load=yes', scheme=SCHEME, dump='scheme')
+    c.open()
+
+    for i in range(10):
+        c.post(name='scalar', data={'i8': i, 'i16': i}, seq=i)
+    c.close()
+
+    db = sqlite3.connect(db_file)
+    assert len(list(db.cursor().execute("SELECT name FROM sqlite_master WHERE type='index' AND tbl_name='scalar'"))) == 3
+
+def test_bulk_load_replace(context, db_file):
+    c = context.Channel(f'sqlite://{db_file};bulk-load=yes;replace=yes;locking-mode=normal', scheme=SCHEME, dump='scheme')
+    c.open()
+
+    for i in range(3):
+        c.post(name='scalar', data={'i8': 10 + i, 'i16': i}, seq=0)
+
+    # Unique indexes are needed by REPLACE and are not deferred
+    db = sqlite3.connect(db_file)
+    query = "SELECT name FROM sqlite_master WHERE type='index' AND tbl_name='scalar'"
+    assert sorted(x[0] for x in db.cursor().execute(query)) == ['_tll_scalar__tll_seq', '_tll_scalar_i8']
+    c.close()
+
+    assert list(db.cursor().execute('SELECT `_tll_seq`, `i8` FROM `scalar`')) == [(0, 12)]
+    assert len(list(db.cursor().execute("SELECT name FROM sqlite_master WHERE type='index' AND tbl_name='scalar'"))) == 3
+
+@pytest.mark.parametrize("url,table,sql", [
+    ('seq-key=rowid', 'scalar', 'CREATE TABLE `scalar` (`_tll_seq` INTEGER PRIMARY KEY, `i8` INTEGER NOT NULL'),
+    ('seq-key=rowid', 'text', 'CREATE TABLE `text` (`_tll_seq` INTEGER PRIMARY KEY, `b` BLOB NOT NULL, `f` VARCHAR NOT NULL, `s` VARCHAR NOT NULL UNIQUE)'),
+    ('without-rowid=yes', 'text', 'CREATE TABLE `text` (`_tll_seq` INTEGER, `b` BLOB NOT NULL, `f` VARCHAR NOT NULL, `s` VARCHAR NOT NULL PRIMARY KEY) WITHOUT ROWID'),
+])
+def test_seq_key(context, db_file, url, table, sql):
+    db = sqlite3.connect(db_file)
+    c = Accum(f'sqlite://{db_file};{url};batch=100', scheme=SCHEME, dump='scheme', context=context)
+    c.open()
+
+    for i in reversed(range(5)):
+        c.post(name='scalar', data={'i8': i, 'i16': i}, seq=i)
+        c.post(name='text', data={'b': b'bytes', 'f': 'fixed', 's': f'key-{4 - i}'}, seq=i)
+
+    created = list(db.cursor().execute("SELECT sql FROM sqlite_master WHERE type='table' AND name=?", (table,)))[0][0]
+    assert created.startswith(sql)
+    indexes = [x[0] for x in db.cursor().execute("SELECT name FROM sqlite_master WHERE type='index' AND tbl_name=?", (table,))]
+    assert (f'_tll_{table}__tll_seq' in indexes) == ('rowid' not in url)
+
+    c.close()
+    c.open(table=table)
+    c.process()
+    assert [x.seq for x in c.result if x.type == x.Type.Data] == list(range(5))
+
+def test_without_rowid_no_key(context, db_file):
+    c = context.Channel(f'sqlite://{db_file};without-rowid=yes', scheme=BULK)
+    with pytest.raises(TLLError):
+        c.open()
+
+def test_upsert(context, db_file):
+    db = sqlite3.connect(db_file)
+    c = context.Channel(f'sqlite://{db_file};upsert=yes', scheme=SCHEME, dump='scheme')
+    c.open()
+
+    c.post(name='text', data={'b': b'bytes', 'f': 'first', 's': 'key'}, seq=1)
+    c.post(name='text', data={'b': b'bytes', 'f': 'other', 's': 'other'}, seq=2)
+    assert list(db.cursor().execute('SELECT `_tll_seq`, `f`, `s` FROM `text` ORDER BY `s`')) == [(1, 'first', 'key'), (2, 'other', 'other')]
+
+    # Same data, row is not changed
+    c.post(name='text', data={'b': b'bytes', 'f': 'first', 's': 'key'}, seq=3)
+    assert list(db.cursor().execute('SELECT `_tll_seq`, `f`, `s` FROM `text` ORDER BY `s`')) == [(1, 'first', 'key'), (2, 'other', 'other')]
+
+    c.post(name='text', data={'b': b'bytes', 'f': 'second', 's': 'key'}, seq=4)
+    assert list(db.cursor().execute('SELECT `_tll_seq`, `f`, `s` FROM `text` ORDER BY `s`')) == [(4, 'second', 'key'), (2, 'other', 'other')]
+
+    # Without primary key unique seq index is used as conflict target
+    c.post(name='scalar', data={'i8': 1, 'i16': 1}, seq=10)
+    c.post(name='scalar', data={'i8': 2, 'i16': 2}, seq=10)
+    assert list(db.cursor().execute('SELECT `_tll_seq`, `i8` FROM `scalar`')) == [(10, 2)]
+
+    with pytest.raises(TLLError):
+        context.Channel(f'sqlite://{db_file};upsert=yes;replace=yes', scheme=SCHEME)
+
+    c.close()
+    c = context.Channel(f'sqlite://{db_file}.noindex;upsert=yes;seq-index=no', scheme=BULK)
+    with pytest.raises(TLLError):
+        c.open()
+
+@pytest.mark.parametrize("ordered", ['yes', 'no'])
+@pytest.mark.parametrize("query,check", [
+    ({}, list(range(100))),
+    ({'seq': '10', 'seq-end': '55'}, list(range(10, 56))),
+    ({'seq': '90', 'seq-end': '200'}, list(range(90, 100))),
+    ({'seq': '200'}, []),
+])
+def test_parallel(context, db_file, ordered, query, check):
+    w = context.Channel(f'sqlite://{db_file};bulk-size=1000', scheme=BULK, name='writer')
+    w.open()
+    for i in range(100):
+        w.post(name='msg', data={'field': i * 2}, seq=i)
+    w.close()
+
+    c = Accum(f'sqlite://{db_file};parallel=4;ordered={ordered};batch=1000', scheme=BULK, name='reader', context=context)
+    c.open(table='msg', **query)
+
+    for _ in range(1000):
+        c.process()
+        if c.state != c.State.Active:
+            break
+        time.sleep(0.001)
+
+    data = [x for x in c.result if x.type == x.Type.Data]
+    seq = [x.seq for x in data]
+    if ordered == 'yes':
+        assert seq == check
+    else:
+        assert sorted(seq) == check
+    assert [c.unpack(x).field for x in data] == [x * 2 for x in seq]
+    assert c.result[-1].msgid == c.scheme_control['EndOfData'].msgid
+
+def test_parallel_limit(context, db_file):
+    w = context.Channel(f'sqlite://{db_file};bulk-size=1000', scheme=BULK, name='writer')
+    w.open()
+    for i in range(100):
+        w.post(name='msg', data={'field': i}, seq=i)
+    w.close()
+
+    c = Accum(f'sqlite://{db_file};parallel=3;batch=1000', scheme=BULK, name='reader', context=context)
+    c.open(table='msg', seq='20', limit='5')
+    for _ in range(1000):
+        c.process()
+        if c.state != c.State.Active:
+            break
+        time.sleep(0.001)
+    assert [x.seq for x in c.result if x.type == x.Type.Data] == list(range(20, 25))
+
+    # Read finished by limit with partitions still running, next read of empty range ends with EndOfData
+    c.result = []
+    c.post({'msgid': 10, 'seq': 200}, name='TableName', type=c.Type.Control)
+    for _ in range(100):
+        c.process()
+        if c.result:
+            break
+        time.sleep(0.001)
+    assert [(x.type, x.msgid) for x in c.result] == [(c.Type.Control, c.scheme_control['EndOfData'].msgid)]
+
+    c.close()
+    c.result = []
+    c.open(table='msg', seq='200')
+    for _ in range(100):
+        c.process()
+        if c.result:
+            break
+        time.sleep(0.001)
+    assert [(x.type, x.msgid) for x in c.result] == [(c.Type.Control, c.scheme_control['EndOfData'].msgid)]
+
+COMPOSITE = '''yamls://
+- name: inner
+  fields:
+    - {name: a, type: int32, options.sql.index: yes}
+    - {name: s, type: string}
+- name: msg
+  id: 10
+  fields:
+    - {name: u64, type: uint64}
+    - {name: dec, type: decimal128}
+    - {name: h, type: inner}
+    - {name: arr, type: 'int16[3]'}
+    - {name: u, type: union, union: [{name: i8, type: int8}, {name: d, type: double}]}
+'''
+
+def test_composite(context, db_file):
+    import decimal
+
+    db = sqlite3.connect(db_file)
+    c = Accum(f'sqlite://{db_file}', scheme=COMPOSITE, dump='scheme', context=context)
+    c.open()
+
+    data = {'u64': 2 ** 64 - 1, 'dec': decimal.Decimal('1.5'), 'h': {'a': 10, 's': 'nested'}, 'arr': [1, 2]}
+    c.post(name='msg', data=dict(data, u={'d': 0.5}), seq=1)
+
+    columns = [x[1:3] for x in db.cursor().execute('PRAGMA table_info(`msg`)')]
+    assert columns == [('_tll_seq', 'INTEGER'), ('u64', 'INTEGER'), ('dec', 'BLOB'), ('h.a', 'INTEGER'), ('h.s', 'VARCHAR'),
+            ('arr', 'BLOB'), ('u._tag', 'INTEGER'), ('u', 'BLOB')]
+    assert list(db.cursor().execute('SELECT `u64`, length(`dec`), `h.a`, `h.s`, `u._tag` FROM `msg`')) == [(-1, 16, 10, 'nested', 1)]
+    indexes = [x[0] for x in db.cursor().execute("SELECT name FROM sqlite_master WHERE type='index' AND tbl_name='msg'")]
+    assert '_tll_msg_h.a' in indexes
+
+    c.close()
+    c.open(table='msg')
+    c.process()
+    result = [c.unpack(x) for x in c.result if x.type == x.Type.Data]
+    assert len(result) == 1
+    r = result[0].as_dict()
+    assert r['u64'] == data['u64']
+    assert r['dec'] == data['dec']
+    assert r['h'] == data['h']
+    assert list(r['arr']) == data['arr']
+    assert result[0].u.d == 0.5
+
+TABLES = '''yamls://
+- name: a
+  id: 10
+  options.sql.table: table_a
+  fields:
+    - {name: f, type: int32}
+- name: b
+  id: 20
+  options.sql.table: table_b
+  fields:
+    - {name: g, type: int64}
+'''
+
+def test_table_switch(context, db_file):
+    c = Accum(f'sqlite://{db_file}', scheme=TABLES, dump='scheme', context=context)
+    c.open()
+    for i in range(3):
+        c.post(name='a', data={'f': i}, seq=2 * i)
+        c.post(name='b', data={'g': i}, seq=2 * i + 1)
+    c.close()
+
+    c.open(table='table_a')
+    c.process()
+    c.post({'msgid': 20}, name='TableName', type=c.Type.Control)
+    c.process()
+    c.post({'msgid': 10, 'seq': 2}, name='TableName', type=c.Type.Control)
+    for _ in range(3):
+        c.process()
+    assert [(x.msgid, x.seq) for x in c.result if x.type == x.Type.Data] == [(10, 0), (20, 1), (10, 2), (10, 4)]
+    assert c.result[-1].msgid == c.scheme_control['EndOfData'].msgid
+
+def test_table_switch_eod(context, db_file):
+    c = Accum(f'sqlite://{db_file}', scheme=TABLES, dump='scheme', context=context)
+    c.open()
+    for i in range(3):
+        c.post(name='a', data={'f': i}, seq=2 * i)
+        c.post(name='b', data={'g': i}, seq=2 * i + 1)
+    c.close()
+
+    c.open(table='table_a')
+    for _ in range(5):
+        c.process()
+    assert [(x.msgid, x.seq) for x in c.result if x.type == x.Type.Data] == [(10, 0), (10, 2), (10, 4)]
+    assert c.result[-1].msgid == c.scheme_control['EndOfData'].msgid
+
+    for t in (20, 10):
+        c.result = []
+        c.post({'msgid': t, 'seq': 1}, name='TableName', type=c.Type.Control)
+        for _ in range(5):
+            c.process()
+        assert [x.seq for x in c.result if x.type == x.Type.Data] == ([1, 3, 5] if t == 20 else [2, 4])
+        assert [x.msgid for x in c.result if x.type == x.Type.Control] == [c.scheme_control['EndOfData'].msgid]
+
+def test_multi_table(context, db_file):
+    c = Accum(f'sqlite://{db_file};batch=100', scheme=TABLES, dump='scheme', context=context)
+    c.open()
+    for i in range(3):
+        c.post(name='a', data={'f': i}, seq=2 * i)
+        c.post(name='b', data={'g': i}, seq=2 * i + 1)
+    c.close()
+
+    c.open(table='table_a,table_b', seq='1', limit='4')
+    c.process()
+    result = [x for x in c.result if x.type == x.Type.Data]
+    assert [(x.msgid, x.seq) for x in result] == [(20, 1), (10, 2), (20, 3), (10, 4)]
+    assert [c.unpack(x).as_dict() for x in result] == [{'g': 0}, {'f': 1}, {'g': 1}, {'f': 2}]
+    assert c.result[-1].msgid == c.scheme_control['EndOfData'].msgid
+
+def test_busy_eagain(context, db_file):
+    import errno
+
+    c = Accum(f'sqlite://{db_file};busy-policy=eagain;busy-backoff=1ms', scheme=BULK, name='writer', context=context)
+    c.open()
+    c.post(name='msg', data={'field': 0}, seq=0)
+
+    db = sqlite3.connect(db_file, isolation_level=None)
+    db.execute('BEGIN IMMEDIATE')
+    for i in range(2):
+        with pytest.raises(TLLError) as e:
+            c.post(name='msg', data={'field': 1}, seq=1)
+        assert e.value.code == errno.EAGAIN
+
+    timer = [x for x in c.children if x.name == 'writer/busy-timer'][0]
+    assert timer.state == timer.State.Active
+    db.execute('COMMIT')
+
+    time.sleep(0.01)
+    timer.process()
+    assert timer.state == timer.State.Closed
+
+    c.post(name='msg', data={'field': 1}, seq=1)
+    assert list(db.execute('SELECT `_tll_seq` FROM `msg`')) == [(0,), (1,)]
+
+COMPRESS = '''yamls://
+- name: msg
+  id: 10
+  fields:
+    - {name: f, type: byte64, options.type: string, options.sql.compress: lz4}
+    - {name: b, type: byte64, options.sql.compress: zstd, options.sql.compress-level: 5}
+    - {name: s, type: string, options.sql.compress: zstd}
+'''
+
+def skip_codec(context, codec):
+    scheme = f'yamls://[{{name: msg, id: 10, fields: [{{name: s, type: string, options.sql.compress: {codec}}}]}}]'
+    c = context.Channel('sqlite://:memory:', scheme=scheme)
+    try:
+        c.open()
+    except TLLError:
+        pytest.skip(f'{codec} compression is not enabled in this build')
+    finally:
+        c.close()
+
+@pytest.mark.parametrize("dict", [False, True])
+def test_compress(context, db_file, tmp_path, dict):
+    for codec in ('zstd', 'lz4'):
+        skip_codec(context, codec)
+
+    scheme = COMPRESS
+    if dict:
+        path = tmp_path / 'dict'
+        path.write_bytes(b'text dictionary ' * 64)
+        scheme = scheme.replace('options.sql.compress: zstd}', f'options.sql.compress: zstd, options.sql.compress-dict: "{path}"}}')
+
+    db = sqlite3.connect(db_file)
+    c = Accum(f'sqlite://{db_file}', scheme=scheme, dump='scheme', context=context)
+    c.open()
+
+    data = [{'f': 'short', 'b': b'\x01\x02' * 16, 's': 'text ' * 200}, {'f': '', 'b': b'', 's': ''}]
+    for i, d in enumerate(data):
+        c.post(name='msg', data=d, seq=i)
+
+    columns = [x[1:3] for x in db.cursor().execute('PRAGMA table_info(`msg`)')]
+    assert columns == [('_tll_seq', 'INTEGER'), ('f', 'BLOB'), ('b', 'BLOB'), ('s', 'BLOB')]
+    assert [x[0] for x in db.cursor().execute('SELECT length(`s`) FROM `msg` WHERE `_tll_seq` = 0')][0] < 100
+
+    c.close()
+    c.open(table='msg')
+    for _ in range(3):
+        c.process()
+    result = [c.unpack(x).as_dict() for x in c.result if x.type == x.Type.Data]
+    assert [r['f'] for r in result] == [d['f'] for d in data]
+    assert [bytes(r['b']).rstrip(b'\0') for r in result] == [d['b'] for d in data]
+    assert [r['s'] for r in result] == [d['s'] for d in data]
+
+    if dict:
+        # Plan with codecs is cached, dictionary is not read again on table switch
+        os.unlink(path)
+        c.result = []
+        c.post({'msgid': 10}, name='TableName', type=c.Type.Control)
+        for _ in range(3):
+            c.process()
+        assert [c.unpack(x).as_dict()['s'] for x in c.result if x.type == x.Type.Data] == [d['s'] for d in data]
+
+def test_compress_invalid(context, db_file):
+    c = Accum(f'sqlite://{db_file}', scheme=SCHEME.replace('{name: i32, type: int32}', '{name: i32, type: int32, options.sql.compress: zstd}'), context=context)
+    with pytest.raises(TLLError):
+        c.open()
+
+    c = Accum(f'sqlite://{db_file}', scheme=COMPRESS.replace('compress: lz4', 'compress: lz4, options.sql.index: yes'), context=context)
+    with pytest.raises(TLLError):
+        c.open()